@@ -1,8 +1,17 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
 #include <limits.h>
 #include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
 
 
 typedef struct Point {
@@ -17,6 +26,8 @@ typedef struct node {
     struct rangeTree *rt;
     int subtree_min;
     int subtree_max;
+    int subtree_size;
+    Point **sample; //APPROX_SAMPLE_SIZE random subtree points, large subtrees above the last level only
 }Node;
 
 
@@ -25,9 +36,30 @@ typedef struct rangeTree {
     int dimensions;
     Node *root;
     Point **points;
+    int *order; //component compared at each level, NULL for 1..d (not owned)
+    struct arena *arena; //owns all memory of the tree when not NULL
 }RangeTree;
 
 
+//per dimension bounds, inclusive, dimensions without a constraint are skipped
+#define BOX_UNBOUNDED 0
+#define BOX_LOWER 1
+#define BOX_UPPER 2
+#define BOX_BOTH (BOX_LOWER | BOX_UPPER)
+
+typedef struct queryBox {
+    int dimensions;
+    int *lower; //INT_MIN when there is no lower bound
+    int *upper; //INT_MAX when there is no upper bound
+    int *constraint;
+}QueryBox;
+
+
+//per node samples for approximate counting
+#define APPROX_SAMPLE_SIZE 128
+#define APPROX_MIN_SUBTREE 512
+
+
 typedef struct LRT {
     int size;
     int dimensions;
@@ -37,10 +69,23 @@ typedef struct LRT {
 
 void print_point(Point *p, int dimensions);
 RangeTree *build_range_tree(Point **points, int size, int dimension, int total_dimensions);
+RangeTree *build_range_tree_ordered(Point **points, int size, int dimension, int total_dimensions, int *order);
+RangeTree *build_range_tree_arena(Point **points, int size, int dimension, int total_dimensions, int *order,
+                                  struct arena *arena);
 int check_subtree_ordering(Node *root, int current_dimension, int min, int max);
 int check_range_tree_ordering(Node *root, int current_dimension, int total_dimensions);
 int check_range_subtrees(Node *root, int current_dimension, int total_dimensions);
 void free_range_tree(RangeTree *rt);
+int count_range_tree(RangeTree *rt, Point *first_bound, Point *second_bound, int dimension);
+int count_box(RangeTree *rt, QueryBox *box, int dimension);
+int report_box(RangeTree *rt, QueryBox *box, int dimension, Point **result, int count);
+QueryBox *box_from_points(Point *first_bound, Point *second_bound, int dimensions);
+void init_box_from_points(QueryBox *box, int *lower, int *upper, int *constraint,
+                          Point *first_bound, Point *second_bound, int dimensions);
+void free_query_box(QueryBox *box);
+int report_range_tree(RangeTree *rt, Point *first_bound, Point *second_bound, int dimension,
+                      Point **result, int count);
+long range_tree_bytes(RangeTree *rt);
 
 
 int max(int first, int second) {
@@ -51,6 +96,107 @@ int min(int first, int second) {
     return first < second ? first : second;
 }
 
+//0 indexed component compared at a 1 indexed level of the tree
+int level_component(int *order, int dimension) {
+    return order == NULL ? dimension-1 : order[dimension-1];
+}
+
+
+//returns a box with every dimension unconstrained
+QueryBox *create_query_box(int dimensions) {
+    QueryBox *box = malloc(sizeof(QueryBox));
+    box->dimensions = dimensions;
+    box->lower = malloc(sizeof(int)*dimensions);
+    box->upper = malloc(sizeof(int)*dimensions);
+    box->constraint = malloc(sizeof(int)*dimensions);
+
+    int i;
+    for (i=0; i<dimensions; i++) {
+        box->lower[i] = INT_MIN;
+        box->upper[i] = INT_MAX;
+        box->constraint[i] = BOX_UNBOUNDED;
+    }
+
+    return box;
+}
+
+
+//dimensions are 1 indexed, bounds are inclusive
+void box_set_lower(QueryBox *box, int dimension, int lower_bound) {
+    box->lower[dimension-1] = lower_bound;
+    box->constraint[dimension-1] |= BOX_LOWER;
+}
+
+
+void box_set_upper(QueryBox *box, int dimension, int upper_bound) {
+    box->upper[dimension-1] = upper_bound;
+    box->constraint[dimension-1] |= BOX_UPPER;
+}
+
+
+void box_set_range(QueryBox *box, int dimension, int first_bound, int second_bound) {
+    box_set_lower(box, dimension, min(first_bound, second_bound));
+    box_set_upper(box, dimension, max(first_bound, second_bound));
+}
+
+
+void box_clear(QueryBox *box, int dimension) {
+    box->lower[dimension-1] = INT_MIN;
+    box->upper[dimension-1] = INT_MAX;
+    box->constraint[dimension-1] = BOX_UNBOUNDED;
+}
+
+
+//box spanned by two corner points, every dimension is constrained
+QueryBox *box_from_points(Point *first_bound, Point *second_bound, int dimensions) {
+    QueryBox *box = create_query_box(dimensions);
+    int i;
+    for (i=0; i<dimensions; i++) {
+        box_set_range(box, i+1, first_bound->components[i], second_bound->components[i]);
+    }
+
+    return box;
+}
+
+
+//same box as box_from_points but over caller provided arrays of dimensions ints,
+//so a box on the stack needs no allocation
+void init_box_from_points(QueryBox *box, int *lower, int *upper, int *constraint,
+                          Point *first_bound, Point *second_bound, int dimensions) {
+    box->dimensions = dimensions;
+    box->lower = lower;
+    box->upper = upper;
+    box->constraint = constraint;
+
+    int i;
+    for (i=0; i<dimensions; i++) {
+        lower[i] = min(first_bound->components[i], second_bound->components[i]);
+        upper[i] = max(first_bound->components[i], second_bound->components[i]);
+        constraint[i] = BOX_BOTH;
+    }
+}
+
+
+void free_query_box(QueryBox *box) {
+    free(box->lower);
+    free(box->upper);
+    free(box->constraint);
+    free(box);
+}
+
+
+//returns 1 if the point is inside the box, 0 otherwise
+int point_in_query_box(Point *p, QueryBox *box) {
+    int i;
+    for (i=0; i<box->dimensions; i++) {
+        if (p->components[i] < box->lower[i] || p->components[i] > box->upper[i]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
 //function to generate random points in d dimensions
 Point **generate_random(int to_generate, int dimensions) {
     srand(time(NULL));
@@ -70,6 +216,25 @@ Point **generate_random(int to_generate, int dimensions) {
 }
 
 
+//values are drawn from only distinct different keys per dimension
+Point **generate_duplicates(int to_generate, int dimensions, int distinct) {
+    srand(time(NULL));
+
+    Point **points = malloc(sizeof(Point*)*to_generate);
+    int i;
+    for (i=0; i<to_generate; i++) {
+        points[i] = malloc(sizeof(Point));
+        points[i]->components = malloc(sizeof(int)*dimensions);
+        int j;
+        for (j=0; j<dimensions; j++) {
+            points[i]->components[j] = rand() % distinct;
+        }
+    }
+
+   return points; 
+}
+
+
 Point **generate_known(int to_generate, int dimensions) {
     srand(time(NULL));
 
@@ -121,28 +286,121 @@ void swap(Point **points, int first, int second) {
 }
 
 
+#define INSERTION_SORT_SIZE 16
+
+
 //[low, high)
-void sort(Point **points, int low, int high, int dimension) {
-    if (high-low <= 1) {
-        return;
+void insertion_sort(Point **points, int low, int high, int dimension) {
+    int i, j;
+    for (i = low+1; i < high; i++) {
+        Point *temp = points[i];
+        int value = temp->components[dimension-1];
+        for (j = i; j > low && points[j-1]->components[dimension-1] > value; j--) {
+            points[j] = points[j-1];
+        }
+        points[j] = temp;
     }
-    int pivot = (rand() % (high-low)) + low;    
-    int pivot_value = points[pivot]->components[dimension-1];
-    swap(points, pivot, high-1);
+}
 
-    int i, small_sorted;
-    for (i = low, small_sorted = 0; i < high-1; i++) {
-        if (points[i]->components[dimension-1] < pivot_value) {
-            swap(points, i, small_sorted+low);
-            small_sorted++;
+
+void sift_down(Point **points, int low, int root, int size, int dimension) {
+    while (2*root + 1 < size) {
+        int child = 2*root + 1;
+        if (child + 1 < size &&
+            points[low+child]->components[dimension-1] < points[low+child+1]->components[dimension-1]) {
+            child++;
+        }
+        if (points[low+root]->components[dimension-1] >= points[low+child]->components[dimension-1]) {
+            return;
         }
+        swap(points, low+root, low+child);
+        root = child;
+    }
+}
+
+
+//[low, high)
+void heap_sort(Point **points, int low, int high, int dimension) {
+    int size = high - low;
+    int i;
+    for (i = size/2 - 1; i >= 0; i--) {
+        sift_down(points, low, i, size, dimension);
+    }
+    for (i = size-1; i > 0; i--) {
+        swap(points, low, low+i);
+        sift_down(points, low, 0, i, dimension);
     }
-    swap(points, small_sorted+low, high-1);
+}
+
 
+//[low, high)
+//introsort: three way quicksort so runs of equal keys are placed in one pass,
+//falls back to heap sort if partitions keep coming out unbalanced.
+//The larger side is pushed and the smaller side handled next so the
+//explicit stack never holds more than log2(n) ranges.
+void sort(Point **points, int low, int high, int dimension) {
+    int stack_low[64], stack_high[64], stack_depth[64];
+    int top = 0;
+
+    int depth_limit = 0;
+    int n;
+    for (n = high-low; n > 1; n >>= 1) {
+        depth_limit += 2;
+    }
 
-    sort(points, low, low+small_sorted, dimension);
-    sort(points, low+small_sorted+1, high, dimension);
+    stack_low[top] = low;
+    stack_high[top] = high;
+    stack_depth[top] = depth_limit;
+    top++;
+
+    while (top > 0) {
+        top--;
+        low = stack_low[top];
+        high = stack_high[top];
+        int depth = stack_depth[top];
+
+        while (high-low > INSERTION_SORT_SIZE) {
+            if (depth == 0) {
+                heap_sort(points, low, high, dimension);
+                break;
+            }
+            depth--;
+
+            int pivot = (rand() % (high-low)) + low;
+            int pivot_value = points[pivot]->components[dimension-1];
+
+            //[low, lt) < pivot, [lt, i) == pivot, [gt, high) > pivot
+            int lt = low, i = low, gt = high;
+            while (i < gt) {
+                int value = points[i]->components[dimension-1];
+                if (value < pivot_value) {
+                    swap(points, lt++, i++);
+                } else if (value > pivot_value) {
+                    swap(points, i, --gt);
+                } else {
+                    i++;
+                }
+            }
+
+            if (lt - low < high - gt) {
+                stack_low[top] = gt;
+                stack_high[top] = high;
+                stack_depth[top] = depth;
+                top++;
+                high = lt;
+            } else {
+                stack_low[top] = low;
+                stack_high[top] = lt;
+                stack_depth[top] = depth;
+                top++;
+                low = gt;
+            }
+        }
 
+        if (high-low <= INSERTION_SORT_SIZE) {
+            insertion_sort(points, low, high, dimension);
+        }
+    }
 }
 
 
@@ -170,7 +428,7 @@ void test_sort(void) {
 
     int dimension;
     for (dimension = 0; dimension < dimensions; dimension++) {
-        sort(points, 0, size, dimension);
+        sort(points, 0, size, dimension+1);
         if (!check_sorted(points, size, dimension)) {
             printf("Sorting Failure!\n"); 
             return;
@@ -191,15 +449,345 @@ void print_tree(Node *root, int dimensions) {
 }
 
 
+/*
+ * Index memory
+ *
+ * Trees built with an arena take their nodes, range trees and last level
+ * point arrays from 2MB chunks instead of individual mallocs. Chunks are
+ * backed by explicit hugepages when the system has them reserved, otherwise
+ * they are 2MB aligned and advised for transparent hugepages, so a query
+ * walking the tree touches far fewer TLB entries. Each arena can also be
+ * bound to one NUMA node or interleaved across all of them; a replicated
+ * tree keeps one copy per node for threads pinned to that node.
+ */
+
+#define HUGEPAGE_SIZE (2UL * 1024 * 1024)
+//older glibc only has the size encoding in linux/mman.h, which clashes with sys/mman.h
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#define ARENA_ALIGNMENT 16
+
+//hugepage backing
+#define ARENA_PAGES_NONE 0
+#define ARENA_PAGES_TRANSPARENT 1
+#define ARENA_PAGES_EXPLICIT 2
+
+//NUMA placement
+#define ARENA_NUMA_DEFAULT 0
+#define ARENA_NUMA_BIND 1
+#define ARENA_NUMA_INTERLEAVE 2
+
+#define MAX_NUMA_NODES 64
+
+
+typedef struct arenaChunk {
+    char *base;
+    size_t size;
+    size_t used;
+    struct arenaChunk *next;
+}ArenaChunk;
+
+
+typedef struct arenaStats {
+    long chunks;
+    long bytes_reserved;
+    long bytes_used;
+    long explicit_chunks; //MAP_HUGETLB with 2MB pages
+    long transparent_chunks; //aligned and madvised
+    long small_page_chunks;
+    long numa_failures;
+}ArenaStats;
+
+
+typedef struct arena {
+    int hugepages;
+    int numa_policy;
+    int numa_node; //only for ARENA_NUMA_BIND
+    ArenaChunk *chunks; //current chunk first
+    ArenaStats stats;
+}Arena;
+
+
+int numa_node_count(void) {
+    int nodes = 0;
+    char path[64];
+    while (nodes < MAX_NUMA_NODES) {
+        sprintf(path, "/sys/devices/system/node/node%d", nodes);
+        if (access(path, F_OK) != 0) {
+            break;
+        }
+        nodes++;
+    }
+
+    return max(nodes, 1);
+}
+
+
+int current_numa_node(void) {
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        return 0;
+    }
+
+    return node;
+}
+
+
+//restricts the calling thread to the cpus of a node, returns 0 for success
+int pin_to_numa_node(int node) {
+    char path[64];
+    sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    //format is "0-3,8-11"
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    int first, last, read;
+    while ((read = fscanf(f, "%d-%d", &first, &last)) >= 1) {
+        if (read == 1) {
+            last = first;
+        }
+        int cpu;
+        for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, &cpus);
+        }
+        if (fgetc(f) != ',') {
+            break;
+        }
+    }
+    fclose(f);
+
+    if (CPU_COUNT(&cpus) == 0) {
+        return -1;
+    }
+
+    return sched_setaffinity(0, sizeof(cpus), &cpus);
+}
+
+
+//applies the arena's NUMA policy to a fresh mapping, before it is touched
+void place_chunk(Arena *arena, char *base, size_t size) {
+    if (arena->numa_policy == ARENA_NUMA_DEFAULT) {
+        return;
+    }
+
+    unsigned long mask = 0;
+    int mode;
+    if (arena->numa_policy == ARENA_NUMA_BIND) {
+        mask = 1UL << arena->numa_node;
+        mode = MPOL_BIND;
+    } else {
+        int nodes = numa_node_count();
+        mask = nodes >= 64 ? ~0UL : (1UL << nodes) - 1;
+        mode = MPOL_INTERLEAVE;
+    }
+
+    if (syscall(SYS_mbind, base, size, mode, &mask, sizeof(mask) * 8, 0) != 0) {
+        arena->stats.numa_failures++;
+    }
+}
+
+
+//maps a 2MB aligned region of size bytes (a multiple of HUGEPAGE_SIZE)
+char *map_chunk(Arena *arena, size_t size) {
+    char *base;
+
+    //asks for 2MB pages explicitly, the default hugepage size may be 1GB
+    if (arena->hugepages == ARENA_PAGES_EXPLICIT) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB,
+                    -1, 0);
+        if (base != MAP_FAILED) {
+            arena->stats.explicit_chunks++;
+            return base;
+        }
+        //no hugepages reserved, fall back to transparent ones
+    }
+
+    if (arena->hugepages == ARENA_PAGES_NONE) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            return NULL;
+        }
+        arena->stats.small_page_chunks++;
+        return base;
+    }
+
+    //over map then trim so the chunk starts on a hugepage boundary
+    char *mapped = mmap(NULL, size + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+        return NULL;
+    }
+    base = (char*)(((unsigned long)mapped + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1));
+    if (base > mapped) {
+        munmap(mapped, base - mapped);
+    }
+    munmap(base + size, (mapped + HUGEPAGE_SIZE) - base);
+
+    if (madvise(base, size, MADV_HUGEPAGE) == 0) {
+        arena->stats.transparent_chunks++;
+    } else {
+        arena->stats.small_page_chunks++;
+    }
+
+    return base;
+}
+
+
+Arena *create_arena(int hugepages, int numa_policy, int numa_node) {
+    Arena *arena = calloc(1, sizeof(Arena));
+    arena->hugepages = hugepages;
+    arena->numa_policy = numa_policy;
+    arena->numa_node = numa_node;
+    arena->chunks = NULL;
+
+    return arena;
+}
+
+
+//falls back to malloc when arena is NULL
+void *arena_alloc(Arena *arena, size_t size) {
+    if (arena == NULL) {
+        return malloc(size);
+    }
+
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    ArenaChunk *chunk = arena->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = (size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+        char *base = map_chunk(arena, chunk_size);
+        if (base == NULL) {
+            printf("Arena mmap failed\n");
+            return NULL;
+        }
+        place_chunk(arena, base, chunk_size);
+
+        chunk = malloc(sizeof(ArenaChunk));
+        chunk->base = base;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+
+        arena->stats.chunks++;
+        arena->stats.bytes_reserved += chunk_size;
+    }
+
+    void *p = chunk->base + chunk->used;
+    chunk->used += size;
+    arena->stats.bytes_used += size;
+
+    return p;
+}
+
+
+void free_arena(Arena *arena) {
+    ArenaChunk *chunk = arena->chunks;
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        munmap(chunk->base, chunk->size);
+        free(chunk);
+        chunk = next;
+    }
+
+    free(arena);
+}
+
+
+//counts the touched pages of the arena on each node, asking the kernel
+//about up to NODE_QUERY_PAGES pages per move_pages call
+#define NODE_QUERY_PAGES 4096
+
+void arena_node_pages(Arena *arena, long *pages, int nodes) {
+    memset(pages, 0, sizeof(long)*nodes);
+    long page_size = sysconf(_SC_PAGESIZE);
+    void **addresses = malloc(sizeof(void*)*NODE_QUERY_PAGES);
+    int *status = malloc(sizeof(int)*NODE_QUERY_PAGES);
+
+    ArenaChunk *chunk;
+    for (chunk = arena->chunks; chunk != NULL; chunk = chunk->next) {
+        size_t offset = 0;
+        while (offset < chunk->used) {
+            long count = 0;
+            for (; offset < chunk->used && count < NODE_QUERY_PAGES; offset += page_size) {
+                addresses[count++] = chunk->base + offset;
+            }
+
+            //with no target nodes move_pages only reports where each page lives,
+            //untouched pages come back as a negative errno
+            if (syscall(SYS_move_pages, 0, count, addresses, NULL, status, 0) != 0) {
+                continue;
+            }
+            long i;
+            for (i=0; i<count; i++) {
+                if (status[i] >= 0 && status[i] < nodes) {
+                    pages[status[i]]++;
+                }
+            }
+        }
+    }
+
+    free(addresses);
+    free(status);
+}
+
+
+//process wide, the kernel does not report it per mapping cheaply
+long anon_hugepage_kb(void) {
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+
+    return kb;
+}
+
+
+void print_arena_stats(Arena *arena) {
+    ArenaStats *stats = &arena->stats;
+    printf("Arena: %ld chunks, %ld bytes reserved, %ld bytes used\n",
+           stats->chunks, stats->bytes_reserved, stats->bytes_used);
+    printf("Pages: %ld explicit hugepage, %ld transparent hugepage, %ld small page chunks\n",
+           stats->explicit_chunks, stats->transparent_chunks, stats->small_page_chunks);
+    printf("Process AnonHugePages: %ld kB\n", anon_hugepage_kb());
+
+    int nodes = numa_node_count();
+    long *pages = malloc(sizeof(long)*nodes);
+    arena_node_pages(arena, pages, nodes);
+    int i;
+    for (i=0; i<nodes; i++) {
+        printf("Node %d: %ld pages\n", i, pages[i]);
+    }
+    if (stats->numa_failures > 0) {
+        printf("NUMA placement failed for %ld chunks\n", stats->numa_failures);
+    }
+    free(pages);
+}
+
+
 //points are still sorted 
-Node *build_subtree(Point **points, int low, int high, int dimension, int total_dimensions) {
+Node *build_subtree(Point **points, int low, int high, int dimension, int total_dimensions, int *order,
+                    Arena *arena) {
     if (high-low == 0) {
         return NULL;
     } 
 
     //printf("High: %d, Low: %d\n", high, low);
     
-    Node *new_node = malloc(sizeof(Node));
+    Node *new_node = arena_alloc(arena, sizeof(Node));
+    int component = level_component(order, dimension);
 
     //subtract 1 to ensure left wins ties
     int pos = ((high-low) / 2) + low - ((high-low+1) % 2);
@@ -207,34 +795,52 @@ Node *build_subtree(Point **points, int low, int high, int dimension, int total_
     //assign point (TODO: Can we switch this to a single int?)
     new_node->point = points[pos];
 
-    //assign children
-    if (high-low > 1) {
-        new_node->left_child = build_subtree(points, low, pos+1, dimension, total_dimensions);
-        new_node->right_child = build_subtree(points, pos+1, high, dimension, total_dimensions);
+    //a run of equal keys is always entirely inside or outside a box on this
+    //level, so above the last level its children would never be visited
+    int equal_run = points[low]->components[component] == points[high-1]->components[component];
+
+    //assign children (split is positional so depth stays log n with duplicates)
+    if (high-low > 1 && !(equal_run && dimension < total_dimensions)) {
+        new_node->left_child = build_subtree(points, low, pos+1, dimension, total_dimensions, order, arena);
+        new_node->right_child = build_subtree(points, pos+1, high, dimension, total_dimensions, order, arena);
     } else {
         new_node->left_child = NULL;
         new_node->right_child = NULL;
     }
 
 
-    new_node->subtree_min = (new_node->left_child == NULL ? new_node->point->components[dimension-1] :
+    new_node->subtree_min = (new_node->left_child == NULL ? new_node->point->components[component] :
                                 new_node->left_child->subtree_min);
 
-    new_node->subtree_max = (new_node->right_child == NULL ? new_node->point->components[dimension-1] :
+    new_node->subtree_max = (new_node->right_child == NULL ? new_node->point->components[component] :
                                 new_node->right_child->subtree_max);
 
+    new_node->subtree_size = high - low;
+
+    //drawn with replacement so the sample fraction is an unbiased estimate
+    new_node->sample = NULL;
+    if (dimension < total_dimensions && high - low >= APPROX_MIN_SUBTREE) {
+        new_node->sample = arena_alloc(arena, sizeof(Point*)*APPROX_SAMPLE_SIZE);
+        int i;
+        for (i=0; i<APPROX_SAMPLE_SIZE; i++) {
+            new_node->sample[i] = points[low + rand() % (high - low)];
+        }
+    }
+
 
     if (dimension < total_dimensions) {
         //construct d-1 range tree
         //printf("Constructing %d Tree\n", dimension+1);
         int new_size = high - low;
-        Point **new_points = malloc(sizeof(Point*)*new_size);
+        //only the last dimension keeps its array, the rest are temporary
+        Point **new_points = dimension < (total_dimensions - 1) ? malloc(sizeof(Point*)*new_size) :
+                                                                  arena_alloc(arena, sizeof(Point*)*new_size);
         int i;
         for(i = 0; i < new_size; i++) {
             new_points[i] = points[i+low];
         }
 
-        new_node->rt = build_range_tree(new_points, new_size, dimension+1, total_dimensions);
+        new_node->rt = build_range_tree_arena(new_points, new_size, dimension+1, total_dimensions, order, arena);
         //Only assign points to last dimension
         if (dimension < (total_dimensions - 1)) {
             free(new_points);
@@ -263,14 +869,31 @@ void free_points(Point **points, int size) {
 //[low, high)
 //sorts points then builds balanced tree based on sorted array
 RangeTree *build_range_tree(Point **points, int size, int dimension, int total_dimensions) {
+    return build_range_tree_ordered(points, size, dimension, total_dimensions, NULL);
+}
+
+
+//same as build_range_tree but level i compares component order[i-1]
+RangeTree *build_range_tree_ordered(Point **points, int size, int dimension, int total_dimensions, int *order) {
+    return build_range_tree_arena(points, size, dimension, total_dimensions, order, NULL);
+}
+
+
+//same as build_range_tree_ordered but every allocation kept by the tree comes from arena,
+//free_range_tree on the returned tree frees the arena. The caller keeps ownership of points
+//even for a 1-D tree, unlike the malloc path where free_range_tree frees a 1-D tree's points
+RangeTree *build_range_tree_arena(Point **points, int size, int dimension, int total_dimensions, int *order,
+                                  Arena *arena) {
     //First Dimension
-    sort(points, 0, size, dimension);
+    sort(points, 0, size, level_component(order, dimension)+1);
     //print_points(points, size, total_dimensions);
     //initialize rt
-    RangeTree *rt = malloc(sizeof(RangeTree));
+    RangeTree *rt = arena_alloc(arena, sizeof(RangeTree));
     rt->size = size;
     rt->dimensions = total_dimensions;
-    rt->root = build_subtree(points, 0, size, dimension, total_dimensions);
+    rt->order = order;
+    rt->arena = arena;
+    rt->root = build_subtree(points, 0, size, dimension, total_dimensions, order, arena);
     if (dimension == total_dimensions) {
         rt->points = points;
     } else {
@@ -735,6 +1358,10 @@ void free_node(Node *root) {
         free_node(root->right_child);
     }
 
+    if (root->sample != NULL) {
+        free(root->sample);
+    }
+
     //free self (free points)
     free(root);    
 
@@ -742,6 +1369,11 @@ void free_node(Node *root) {
 
 
 void free_range_tree(RangeTree *rt) {
+    if (rt->arena != NULL) {
+        free_arena(rt->arena);
+        return;
+    }
+
     Node *root = rt->root;
 
     free_node(root);
@@ -794,7 +1426,1755 @@ void test_query(void) {
 
 }
 
+//counts points inside the box using the canonical decomposition of each level
+int count_subtree(Node *root, QueryBox *box, int dimension, int total_dimensions, int *order) {
+    if (root == NULL) {
+        return 0;
+    }
+
+    int component = level_component(order, dimension);
+    int lower_bound = box->lower[component];
+    int upper_bound = box->upper[component];
+
+    if (root->subtree_min > upper_bound || root->subtree_max < lower_bound) {
+        return 0;
+    }
+
+    if (root->subtree_min >= lower_bound && root->subtree_max <= upper_bound) {
+        if (dimension == total_dimensions) {
+            return root->subtree_size;
+        }
+        return count_box(root->rt, box, dimension+1);
+    }
+
+    return count_subtree(root->left_child, box, dimension, total_dimensions, order) +
+           count_subtree(root->right_child, box, dimension, total_dimensions, order);
+}
+
+
+int count_box(RangeTree *rt, QueryBox *box, int dimension) {
+    if (rt == NULL || rt->root == NULL) {
+        return 0;
+    }
+
+    //every point in this tree qualifies on unconstrained levels, skip them
+    while (box->constraint[level_component(rt->order, dimension)] == BOX_UNBOUNDED) {
+        if (dimension == rt->dimensions) {
+            return rt->size;
+        }
+        rt = rt->root->rt;
+        dimension++;
+    }
+
+    return count_subtree(rt->root, box, dimension, rt->dimensions, rt->order);
+}
+
+
+//inclusive on both ends
+int count_range_tree(RangeTree *rt, Point *first_bound, Point *second_bound, int dimension) {
+    if (rt == NULL) {
+        return 0;
+    }
+
+    int lower[rt->dimensions], upper[rt->dimensions], constraint[rt->dimensions];
+    QueryBox box;
+    init_box_from_points(&box, lower, upper, constraint, first_bound, second_bound, rt->dimensions);
+
+    return count_box(rt, &box, dimension);
+}
+
+
+//appends every point stored in the leaves of a last level subtree
+int report_leaves(Node *root, Point **result, int count) {
+    if (root == NULL) {
+        return count;
+    }
+
+    if (root->left_child == NULL && root->right_child == NULL) {
+        result[count++] = root->point;
+        return count;
+    }
+
+    count = report_leaves(root->left_child, result, count);
+    return report_leaves(root->right_child, result, count);
+}
+
+
+//same traversal as count_subtree, appends points to result and returns new count
+int report_subtree(Node *root, QueryBox *box, int dimension, int total_dimensions,
+                   int *order, Point **result, int count) {
+    if (root == NULL) {
+        return count;
+    }
+
+    int component = level_component(order, dimension);
+    int lower_bound = box->lower[component];
+    int upper_bound = box->upper[component];
+
+    if (root->subtree_min > upper_bound || root->subtree_max < lower_bound) {
+        return count;
+    }
+
+    if (root->subtree_min >= lower_bound && root->subtree_max <= upper_bound) {
+        if (dimension == total_dimensions) {
+            return report_leaves(root, result, count);
+        }
+        return report_box(root->rt, box, dimension+1, result, count);
+    }
+
+    count = report_subtree(root->left_child, box, dimension, total_dimensions, order, result, count);
+    return report_subtree(root->right_child, box, dimension, total_dimensions, order, result, count);
+}
+
+
+//result must have room for count_box points
+int report_box(RangeTree *rt, QueryBox *box, int dimension, Point **result, int count) {
+    if (rt == NULL || rt->root == NULL) {
+        return count;
+    }
+
+    while (box->constraint[level_component(rt->order, dimension)] == BOX_UNBOUNDED) {
+        if (dimension == rt->dimensions) {
+            //last level keeps its points sorted in an array
+            memcpy(result+count, rt->points, sizeof(Point*)*rt->size);
+            return count + rt->size;
+        }
+        rt = rt->root->rt;
+        dimension++;
+    }
+
+    return report_subtree(rt->root, box, dimension, rt->dimensions, rt->order, result, count);
+}
+
+
+//result must have room for count_range_tree points
+int report_range_tree(RangeTree *rt, Point *first_bound, Point *second_bound, int dimension,
+                      Point **result, int count) {
+    if (rt == NULL) {
+        return count;
+    }
+
+    int lower[rt->dimensions], upper[rt->dimensions], constraint[rt->dimensions];
+    QueryBox box;
+    init_box_from_points(&box, lower, upper, constraint, first_bound, second_bound, rt->dimensions);
+
+    return report_box(rt, &box, dimension, result, count);
+}
+
+
+/*
+ * Approximate counting
+ *
+ * Large nodes above the last level keep a random sample of their subtree.
+ * When a box fully contains such a node, the node's points already satisfy
+ * this level and the ones before it. The fraction of the sample inside the
+ * box then estimates how many of them survive the remaining levels, so the
+ * query can stop there instead of descending into node->rt. Each estimate
+ * carries a ~95% normal approximation half-width. Canonical nodes are
+ * estimated largest first while the summed half-widths stay within the
+ * caller's epsilon, and everything else is counted exactly.
+ */
+
+#define APPROX_Z 1.96
+
+
+typedef struct approxCount {
+    double estimate;
+    //sum of the sampled nodes' ~95% confidence half-widths, not a hard bound:
+    //each sampled node's error stays within its half-width about 95% of the time
+    double confidence_half_width;
+    int sampled_nodes;
+}ApproxCount;
+
+
+//half-width of the estimate for a node, 1/s keeps it above 0 when no or all samples match
+double sample_error(int size, int inside) {
+    double p = (double)inside / APPROX_SAMPLE_SIZE;
+    return size * (APPROX_Z * sqrt(p * (1.0 - p) / APPROX_SAMPLE_SIZE) + 1.0 / APPROX_SAMPLE_SIZE);
+}
+
+
+//gathers the canonical nodes of one level, the subtrees fully inside the box
+void collect_canonical(Node *root, QueryBox *box, int component, Node **nodes, int *count) {
+    if (root == NULL) {
+        return;
+    }
+
+    if (root->subtree_min > box->upper[component] || root->subtree_max < box->lower[component]) {
+        return;
+    }
+
+    if (root->subtree_min >= box->lower[component] && root->subtree_max <= box->upper[component]) {
+        nodes[(*count)++] = root;
+        return;
+    }
+
+    collect_canonical(root->left_child, box, component, nodes, count);
+    collect_canonical(root->right_child, box, component, nodes, count);
+}
+
+
+//largest canonical nodes are estimated first since they are the most expensive to count exactly
+void approx_count_rt(RangeTree *rt, QueryBox *box, int dimension, double *budget, ApproxCount *result) {
+    if (rt == NULL || rt->root == NULL) {
+        return;
+    }
+
+    while (box->constraint[level_component(rt->order, dimension)] == BOX_UNBOUNDED) {
+        if (dimension == rt->dimensions) {
+            result->estimate += rt->size;
+            return;
+        }
+        rt = rt->root->rt;
+        dimension++;
+    }
+
+    //at most two per level of a tree over INT_MAX points
+    Node *nodes[128];
+    int count = 0;
+    collect_canonical(rt->root, box, level_component(rt->order, dimension), nodes, &count);
+
+    int i, j;
+    for (i=1; i<count; i++) {
+        Node *temp = nodes[i];
+        for (j = i; j > 0 && nodes[j-1]->subtree_size < temp->subtree_size; j--) {
+            nodes[j] = nodes[j-1];
+        }
+        nodes[j] = temp;
+    }
+
+    for (i=0; i<count; i++) {
+        Node *node = nodes[i];
+        if (dimension == rt->dimensions) {
+            result->estimate += node->subtree_size;
+            continue;
+        }
+
+        //decide on the worst case (half the sample inside) so a scan is never wasted
+        if (node->sample != NULL && sample_error(node->subtree_size, APPROX_SAMPLE_SIZE/2) <= *budget) {
+            int inside = 0;
+            for (j=0; j<APPROX_SAMPLE_SIZE; j++) {
+                inside += point_in_query_box(node->sample[j], box);
+            }
+
+            double error = sample_error(node->subtree_size, inside);
+            *budget -= error;
+            result->estimate += (double)node->subtree_size * inside / APPROX_SAMPLE_SIZE;
+            result->confidence_half_width += error;
+            result->sampled_nodes++;
+            continue;
+        }
+
+        approx_count_rt(node->rt, box, dimension+1, budget, result);
+    }
+}
+
+
+//estimate of count_box whose confidence_half_width is at most epsilon, epsilon 0 gives the exact count
+ApproxCount approx_count_box(RangeTree *rt, QueryBox *box, double epsilon) {
+    ApproxCount result;
+    result.estimate = 0.0;
+    result.confidence_half_width = 0.0;
+    result.sampled_nodes = 0;
+
+    double budget = epsilon;
+    approx_count_rt(rt, box, 1, &budget, &result);
+
+    return result;
+}
+
+
+
+//approximate heap footprint of a range tree and all of its sub trees
+long node_bytes(Node *root) {
+    if (root == NULL) {
+        return 0;
+    }
+
+    long bytes = sizeof(Node);
+    if (root->rt != NULL) {
+        bytes += range_tree_bytes(root->rt);
+    }
+    if (root->sample != NULL) {
+        bytes += sizeof(Point*) * APPROX_SAMPLE_SIZE;
+    }
+
+    return bytes + node_bytes(root->left_child) + node_bytes(root->right_child);
+}
+
+
+long range_tree_bytes(RangeTree *rt) {
+    long bytes = sizeof(RangeTree) + node_bytes(rt->root);
+    if (rt->points != NULL) {
+        bytes += sizeof(Point*) * rt->size;
+    }
+
+    return bytes;
+}
+
+
+//returns 1 if the point is inside the box spanned by the bounds, 0 otherwise
+int point_in_box(Point *p, Point *first_bound, Point *second_bound, int dimensions) {
+    int i;
+    for (i=0; i<dimensions; i++) {
+        int lower_bound = min(first_bound->components[i], second_bound->components[i]);
+        int upper_bound = max(first_bound->components[i], second_bound->components[i]);
+        if (p->components[i] < lower_bound || p->components[i] > upper_bound) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+int count_brute_force(Point **points, int size, int dimensions, Point *first_bound, Point *second_bound) {
+    int i, count = 0;
+    for (i=0; i<size; i++) {
+        count += point_in_box(points[i], first_bound, second_bound, dimensions);
+    }
+
+    return count;
+}
+
+
+/*
+ * Wavelet backend
+ *
+ * Points are reduced to rank space: sorted by one dimension (x) so a range of
+ * x values becomes a range of positions, and the other dimension (y) is
+ * replaced by its rank among the distinct y values. The y ranks are stored in
+ * a wavelet matrix, one rank bitvector per bit of the rank, so a 2-D count
+ * is O(log n) using O(n log n) bits. Points are kept in the order of the
+ * bottom level so reporting costs O(log n) per matching leaf plus O(1) per
+ * point instead of a select walk back up. The 3-D index is a balanced tree over the first dimension
+ * with a 2-D grid over dimensions 2 and 3 in each node.
+ */
+
+#define WORD_BITS 64
+#define WAVELET_LEAF_SIZE 32
+
+
+typedef struct bitVector {
+    int size;
+    unsigned long long *bits;
+    int *block_rank; //number of ones before each word
+}BitVector;
+
+
+typedef struct waveletMatrix {
+    int size;
+    int levels;
+    BitVector *bit_vectors;
+    int *zeros; //number of zeros on each level
+}WaveletMatrix;
+
+
+typedef struct waveletGrid {
+    int size;
+    int x_dimension;
+    int y_dimension;
+    Point **points; //in bottom level order of the wavelet matrix
+    int *xs; //sorted
+    int *ys; //distinct y values, sorted
+    int y_count;
+    WaveletMatrix *wm;
+}WaveletGrid;
+
+
+typedef struct waveletNode {
+    int low;
+    int high;
+    WaveletGrid *grid; //NULL for leaves, which are scanned
+    struct waveletNode *left_child;
+    struct waveletNode *right_child;
+}WaveletNode;
+
+
+typedef struct waveletIndex {
+    int size;
+    int dimensions;
+    WaveletGrid *grid; //2-D
+    Point **points; //3-D, sorted by the first dimension
+    int *keys;
+    WaveletNode *root;
+}WaveletIndex;
+
+
+void init_bit_vector(BitVector *bv, int size) {
+    int words = size / WORD_BITS + 1;
+    bv->size = size;
+    bv->bits = calloc(words, sizeof(unsigned long long));
+    bv->block_rank = calloc(words, sizeof(int));
+}
+
+
+void set_bit(BitVector *bv, int i) {
+    bv->bits[i / WORD_BITS] |= 1ULL << (i % WORD_BITS);
+}
+
+
+void finalize_bit_vector(BitVector *bv) {
+    int words = bv->size / WORD_BITS + 1;
+    int i, ones = 0;
+    for (i=0; i<words; i++) {
+        bv->block_rank[i] = ones;
+        ones += __builtin_popcountll(bv->bits[i]);
+    }
+}
+
+
+//number of ones in [0, i)
+int rank1(BitVector *bv, int i) {
+    int word = i / WORD_BITS;
+    int offset = i % WORD_BITS;
+    unsigned long long mask = (1ULL << offset) - 1;
+    return bv->block_rank[word] + __builtin_popcountll(bv->bits[word] & mask);
+}
+
+
+int rank0(BitVector *bv, int i) {
+    return i - rank1(bv, i);
+}
+
+
+void free_bit_vector(BitVector *bv) {
+    free(bv->bits);
+    free(bv->block_rank);
+}
+
+
+//values must lie in [0, alphabet)
+//if order is not NULL it receives the original position of each bottom level position
+WaveletMatrix *build_wavelet_matrix(int *values, int size, int alphabet, int *order) {
+    WaveletMatrix *wm = malloc(sizeof(WaveletMatrix));
+    wm->size = size;
+    wm->levels = 1;
+    while ((1 << wm->levels) < alphabet) {
+        wm->levels++;
+    }
+    wm->bit_vectors = malloc(sizeof(BitVector)*wm->levels);
+    wm->zeros = malloc(sizeof(int)*wm->levels);
+
+    int *current = malloc(sizeof(int)*size);
+    int *next = malloc(sizeof(int)*size);
+    int *current_order = malloc(sizeof(int)*size);
+    int *next_order = malloc(sizeof(int)*size);
+    memcpy(current, values, sizeof(int)*size);
+
+    int i;
+    for (i=0; i<size; i++) {
+        current_order[i] = i;
+    }
+
+    int level;
+    for (level = 0; level < wm->levels; level++) {
+        int shift = wm->levels - 1 - level;
+        BitVector *bv = &wm->bit_vectors[level];
+        init_bit_vector(bv, size);
+
+        for (i=0; i<size; i++) {
+            if ((current[i] >> shift) & 1) {
+                set_bit(bv, i);
+            }
+        }
+        finalize_bit_vector(bv);
+        wm->zeros[level] = rank0(bv, size);
+
+        //stable partition, zeros first
+        int zero_pos = 0, one_pos = wm->zeros[level];
+        for (i=0; i<size; i++) {
+            if ((current[i] >> shift) & 1) {
+                next_order[one_pos] = current_order[i];
+                next[one_pos++] = current[i];
+            } else {
+                next_order[zero_pos] = current_order[i];
+                next[zero_pos++] = current[i];
+            }
+        }
+
+        int *temp = current;
+        current = next;
+        next = temp;
+        temp = current_order;
+        current_order = next_order;
+        next_order = temp;
+    }
+
+    if (order != NULL) {
+        memcpy(order, current_order, sizeof(int)*size);
+    }
+
+    free(current);
+    free(next);
+    free(current_order);
+    free(next_order);
+
+    return wm;
+}
+
+
+//number of values < value in positions [low, high)
+int wavelet_count_less(WaveletMatrix *wm, int low, int high, int value) {
+    if (value >= (1 << wm->levels)) {
+        return high - low;
+    }
+
+    int count = 0;
+    int level;
+    for (level = 0; level < wm->levels && low < high; level++) {
+        BitVector *bv = &wm->bit_vectors[level];
+        int zeros_low = rank0(bv, low);
+        int zeros_high = rank0(bv, high);
+        if ((value >> (wm->levels - 1 - level)) & 1) {
+            count += zeros_high - zeros_low;
+            low = wm->zeros[level] + (low - zeros_low);
+            high = wm->zeros[level] + (high - zeros_high);
+        } else {
+            low = zeros_low;
+            high = zeros_high;
+        }
+    }
+
+    return count;
+}
+
+
+//appends the bottom level positions that started in [low, high) with a value in [value_low, value_high)
+void wavelet_collect(WaveletMatrix *wm, int level, int low, int high, int prefix,
+                     int value_low, int value_high, int *positions, int *count) {
+    if (low >= high) {
+        return;
+    }
+
+    int span = wm->levels - level;
+    int node_low = prefix << span;
+    int node_high = (prefix + 1) << span;
+    if (node_high <= value_low || node_low >= value_high) {
+        return;
+    }
+
+    if (level == wm->levels) {
+        int i;
+        for (i=low; i<high; i++) {
+            positions[(*count)++] = i;
+        }
+        return;
+    }
+
+    BitVector *bv = &wm->bit_vectors[level];
+    int zeros_low = rank0(bv, low);
+    int zeros_high = rank0(bv, high);
+    wavelet_collect(wm, level+1, zeros_low, zeros_high, prefix << 1,
+                    value_low, value_high, positions, count);
+    wavelet_collect(wm, level+1, wm->zeros[level] + (low - zeros_low), wm->zeros[level] + (high - zeros_high),
+                    (prefix << 1) | 1, value_low, value_high, positions, count);
+}
+
+
+void free_wavelet_matrix(WaveletMatrix *wm) {
+    int level;
+    for (level = 0; level < wm->levels; level++) {
+        free_bit_vector(&wm->bit_vectors[level]);
+    }
+    free(wm->bit_vectors);
+    free(wm->zeros);
+    free(wm);
+}
+
+
+long wavelet_matrix_bytes(WaveletMatrix *wm) {
+    long words = wm->size / WORD_BITS + 1;
+    return sizeof(WaveletMatrix) + wm->levels * (sizeof(BitVector) + sizeof(int) +
+           words * (sizeof(unsigned long long) + sizeof(int)));
+}
+
+
+//first index with values[i] >= key
+int lower_bound_int(int *values, int size, int key) {
+    int low = 0, high = size;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (values[mid] < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+
+//first index with values[i] > key
+int upper_bound_int(int *values, int size, int key) {
+    int low = 0, high = size;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (values[mid] <= key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+
+int compare_ints(const void *first, const void *second) {
+    int a = *(const int*)first;
+    int b = *(const int*)second;
+    return (a > b) - (a < b);
+}
+
+
+//copies points, dimensions are 1 indexed like the range tree
+WaveletGrid *build_wavelet_grid(Point **points, int size, int x_dimension, int y_dimension) {
+    WaveletGrid *grid = malloc(sizeof(WaveletGrid));
+    grid->size = size;
+    grid->x_dimension = x_dimension;
+    grid->y_dimension = y_dimension;
+
+    grid->points = malloc(sizeof(Point*)*size);
+    memcpy(grid->points, points, sizeof(Point*)*size);
+    sort(grid->points, 0, size, x_dimension);
+
+    grid->xs = malloc(sizeof(int)*size);
+    grid->ys = malloc(sizeof(int)*size);
+    int i;
+    for (i=0; i<size; i++) {
+        grid->xs[i] = grid->points[i]->components[x_dimension-1];
+        grid->ys[i] = grid->points[i]->components[y_dimension-1];
+    }
+
+    //reduce y to rank space
+    qsort(grid->ys, size, sizeof(int), compare_ints);
+    grid->y_count = 0;
+    for (i=0; i<size; i++) {
+        if (grid->y_count == 0 || grid->ys[grid->y_count-1] != grid->ys[i]) {
+            grid->ys[grid->y_count++] = grid->ys[i];
+        }
+    }
+
+    int *ranks = malloc(sizeof(int)*size);
+    for (i=0; i<size; i++) {
+        ranks[i] = lower_bound_int(grid->ys, grid->y_count, grid->points[i]->components[y_dimension-1]);
+    }
+    //store points in bottom level order so reporting needs no select
+    int *order = malloc(sizeof(int)*size);
+    grid->wm = build_wavelet_matrix(ranks, size, grid->y_count, order);
+    Point **sorted_points = grid->points;
+    grid->points = malloc(sizeof(Point*)*size);
+    for (i=0; i<size; i++) {
+        grid->points[i] = sorted_points[order[i]];
+    }
+    free(sorted_points);
+    free(order);
+    free(ranks);
+
+    return grid;
+}
+
+
+//converts the bounds into a position range and a y rank range
+void grid_ranks(WaveletGrid *grid, Point *first_bound, Point *second_bound,
+                int *low, int *high, int *value_low, int *value_high) {
+    int x = grid->x_dimension - 1;
+    int y = grid->y_dimension - 1;
+    *low = lower_bound_int(grid->xs, grid->size, min(first_bound->components[x], second_bound->components[x]));
+    *high = upper_bound_int(grid->xs, grid->size, max(first_bound->components[x], second_bound->components[x]));
+    *value_low = lower_bound_int(grid->ys, grid->y_count, min(first_bound->components[y], second_bound->components[y]));
+    *value_high = upper_bound_int(grid->ys, grid->y_count, max(first_bound->components[y], second_bound->components[y]));
+}
+
+
+int grid_count(WaveletGrid *grid, Point *first_bound, Point *second_bound) {
+    int low, high, value_low, value_high;
+    grid_ranks(grid, first_bound, second_bound, &low, &high, &value_low, &value_high);
+    if (low >= high || value_low >= value_high) {
+        return 0;
+    }
+
+    return wavelet_count_less(grid->wm, low, high, value_high) -
+           wavelet_count_less(grid->wm, low, high, value_low);
+}
+
+
+//appends matching points to result, returns new count
+int grid_report(WaveletGrid *grid, Point *first_bound, Point *second_bound, Point **result, int count) {
+    int low, high, value_low, value_high;
+    grid_ranks(grid, first_bound, second_bound, &low, &high, &value_low, &value_high);
+    if (low >= high || value_low >= value_high) {
+        return count;
+    }
+
+    int *positions = malloc(sizeof(int)*(high-low));
+    int found = 0;
+    wavelet_collect(grid->wm, 0, low, high, 0, value_low, value_high, positions, &found);
+
+    int i;
+    for (i=0; i<found; i++) {
+        result[count++] = grid->points[positions[i]];
+    }
+    free(positions);
+
+    return count;
+}
+
+
+void free_wavelet_grid(WaveletGrid *grid) {
+    free_wavelet_matrix(grid->wm);
+    free(grid->points);
+    free(grid->xs);
+    free(grid->ys);
+    free(grid);
+}
+
+
+long wavelet_grid_bytes(WaveletGrid *grid) {
+    return sizeof(WaveletGrid) + wavelet_matrix_bytes(grid->wm) +
+           grid->size * (sizeof(Point*) + sizeof(int)) + grid->y_count * sizeof(int);
+}
+
+
+//[low, high) of the index points sorted by the first dimension
+WaveletNode *build_wavelet_node(Point **points, int low, int high) {
+    WaveletNode *node = malloc(sizeof(WaveletNode));
+    node->low = low;
+    node->high = high;
+
+    if (high - low <= WAVELET_LEAF_SIZE) {
+        node->grid = NULL;
+        node->left_child = NULL;
+        node->right_child = NULL;
+        return node;
+    }
+
+    node->grid = build_wavelet_grid(points+low, high-low, 2, 3);
+    int mid = (low + high) / 2;
+    node->left_child = build_wavelet_node(points, low, mid);
+    node->right_child = build_wavelet_node(points, mid, high);
+
+    return node;
+}
+
+
+void free_wavelet_node(WaveletNode *node) {
+    if (node == NULL) {
+        return;
+    }
+
+    if (node->grid != NULL) {
+        free_wavelet_grid(node->grid);
+    }
+    free_wavelet_node(node->left_child);
+    free_wavelet_node(node->right_child);
+    free(node);
+}
+
+
+long wavelet_node_bytes(WaveletNode *node) {
+    if (node == NULL) {
+        return 0;
+    }
+
+    long bytes = sizeof(WaveletNode);
+    if (node->grid != NULL) {
+        bytes += wavelet_grid_bytes(node->grid);
+    }
+
+    return bytes + wavelet_node_bytes(node->left_child) + wavelet_node_bytes(node->right_child);
+}
+
+
+//alternative to build_range_tree for 2 and 3 dimensions, does not reorder points
+WaveletIndex *build_wavelet_index(Point **points, int size, int dimensions) {
+    if (dimensions != 2 && dimensions != 3) {
+        printf("Wavelet index only supports 2 or 3 dimensions\n");
+        return NULL;
+    }
+
+    WaveletIndex *wi = malloc(sizeof(WaveletIndex));
+    wi->size = size;
+    wi->dimensions = dimensions;
+    wi->grid = NULL;
+    wi->points = NULL;
+    wi->keys = NULL;
+    wi->root = NULL;
+
+    if (dimensions == 2) {
+        wi->grid = build_wavelet_grid(points, size, 1, 2);
+        return wi;
+    }
+
+    wi->points = malloc(sizeof(Point*)*size);
+    memcpy(wi->points, points, sizeof(Point*)*size);
+    sort(wi->points, 0, size, 1);
+
+    wi->keys = malloc(sizeof(int)*size);
+    int i;
+    for (i=0; i<size; i++) {
+        wi->keys[i] = wi->points[i]->components[0];
+    }
+    wi->root = build_wavelet_node(wi->points, 0, size);
+
+    return wi;
+}
+
+
+//[low, high) is the range of first dimension ranks in the box
+int wavelet_node_count(WaveletIndex *wi, WaveletNode *node, int low, int high,
+                       Point *first_bound, Point *second_bound) {
+    if (node == NULL || node->high <= low || node->low >= high) {
+        return 0;
+    }
+
+    if (node->grid != NULL && low <= node->low && node->high <= high) {
+        return grid_count(node->grid, first_bound, second_bound);
+    }
+
+    if (node->grid == NULL) {
+        int from = max(low, node->low);
+        int to = min(high, node->high);
+        return count_brute_force(wi->points+from, to-from, 3, first_bound, second_bound);
+    }
+
+    return wavelet_node_count(wi, node->left_child, low, high, first_bound, second_bound) +
+           wavelet_node_count(wi, node->right_child, low, high, first_bound, second_bound);
+}
+
+
+int wavelet_node_report(WaveletIndex *wi, WaveletNode *node, int low, int high,
+                        Point *first_bound, Point *second_bound, Point **result, int count) {
+    if (node == NULL || node->high <= low || node->low >= high) {
+        return count;
+    }
+
+    if (node->grid != NULL && low <= node->low && node->high <= high) {
+        return grid_report(node->grid, first_bound, second_bound, result, count);
+    }
+
+    if (node->grid == NULL) {
+        int i;
+        for (i=max(low, node->low); i<min(high, node->high); i++) {
+            if (point_in_box(wi->points[i], first_bound, second_bound, 3)) {
+                result[count++] = wi->points[i];
+            }
+        }
+        return count;
+    }
+
+    count = wavelet_node_report(wi, node->left_child, low, high, first_bound, second_bound, result, count);
+    return wavelet_node_report(wi, node->right_child, low, high, first_bound, second_bound, result, count);
+}
+
+
+void wavelet_first_ranks(WaveletIndex *wi, Point *first_bound, Point *second_bound, int *low, int *high) {
+    *low = lower_bound_int(wi->keys, wi->size, min(first_bound->components[0], second_bound->components[0]));
+    *high = upper_bound_int(wi->keys, wi->size, max(first_bound->components[0], second_bound->components[0]));
+}
+
+
+int wavelet_count(WaveletIndex *wi, Point *first_bound, Point *second_bound) {
+    if (wi->dimensions == 2) {
+        return grid_count(wi->grid, first_bound, second_bound);
+    }
+
+    int low, high;
+    wavelet_first_ranks(wi, first_bound, second_bound, &low, &high);
+    return wavelet_node_count(wi, wi->root, low, high, first_bound, second_bound);
+}
+
+
+//returns NULL-TERMINATED list of points in the box, NULL if there are none
+Point **wavelet_query(WaveletIndex *wi, Point *first_bound, Point *second_bound) {
+    int count = wavelet_count(wi, first_bound, second_bound);
+    if (count == 0) {
+        return NULL;
+    }
+
+    Point **result = calloc(count+1, sizeof(Point*));
+    if (wi->dimensions == 2) {
+        grid_report(wi->grid, first_bound, second_bound, result, 0);
+    } else {
+        int low, high;
+        wavelet_first_ranks(wi, first_bound, second_bound, &low, &high);
+        wavelet_node_report(wi, wi->root, low, high, first_bound, second_bound, result, 0);
+    }
+
+    return result;
+}
+
+
+void free_wavelet_index(WaveletIndex *wi) {
+    if (wi->grid != NULL) {
+        free_wavelet_grid(wi->grid);
+    }
+    free_wavelet_node(wi->root);
+    if (wi->points != NULL) {
+        free(wi->points);
+    }
+    if (wi->keys != NULL) {
+        free(wi->keys);
+    }
+    free(wi);
+}
+
+
+long wavelet_index_bytes(WaveletIndex *wi) {
+    long bytes = sizeof(WaveletIndex);
+    if (wi->grid != NULL) {
+        bytes += wavelet_grid_bytes(wi->grid);
+    }
+    if (wi->points != NULL) {
+        bytes += wi->size * (sizeof(Point*) + sizeof(int));
+    }
+
+    return bytes + wavelet_node_bytes(wi->root);
+}
+
+
+double elapsed_seconds(clock_t start) {
+    return ((double) (clock() - start)) / CLOCKS_PER_SEC;
+}
+
+
+//builds over a copy of points so the caller's array keeps its order,
+//free_range_tree releases everything including the copy
+RangeTree *build_range_tree_copy(Point **points, int size, int dimensions, int *order, Arena *arena) {
+    Point **tree_points = arena_alloc(arena, sizeof(Point*)*size);
+    memcpy(tree_points, points, sizeof(Point*)*size);
+    RangeTree *rt = build_range_tree_arena(tree_points, size, 1, dimensions, order, arena);
+
+    //only a 1-D malloc tree keeps its top level array
+    if (arena == NULL && dimensions > 1) {
+        free(tree_points);
+    }
+
+    return rt;
+}
+
+
+//brute force count for each of the queries boxes spanned by query_points[2*i] and [2*i+1]
+int *brute_force_counts(Point **points, int size, int dimensions, Point **query_points, int queries) {
+    int *expected = malloc(sizeof(int)*queries);
+    int i;
+    for (i=0; i<queries; i++) {
+        expected[i] = count_brute_force(points, size, dimensions, query_points[2*i], query_points[2*i+1]);
+    }
+
+    return expected;
+}
+
+
+void print_bench_result(const char *name, int errors) {
+    if (errors == 0) {
+        printf("Success!\n");
+    } else {
+        printf("%s Failure! %d errors\n", name, errors);
+    }
+}
+
+
+//compares the wavelet backend against the range tree for counts and reports
+void bench_wavelet_index(int size, int dimensions, int queries) {
+    printf("Wavelet vs Range Tree: %d points, %d dimensions, %d queries\n", size, dimensions, queries);
+    Point **points = generate_random(size, dimensions);
+    Point **query_points = generate_random(2*queries, dimensions);
+
+    clock_t t = clock();
+    WaveletIndex *wi = build_wavelet_index(points, size, dimensions);
+    printf("Wavelet Build: %f seconds, %ld bytes\n", elapsed_seconds(t), wavelet_index_bytes(wi));
+
+    t = clock();
+    RangeTree *rt = build_range_tree_copy(points, size, dimensions, NULL, NULL);
+    printf("Range Tree Build: %f seconds, %ld bytes\n", elapsed_seconds(t), range_tree_bytes(rt));
+
+    int *expected = brute_force_counts(points, size, dimensions, query_points, queries);
+    int errors = 0;
+    int i;
+    long total = 0;
+    t = clock();
+    for (i=0; i<queries; i++) {
+        errors += wavelet_count(wi, query_points[2*i], query_points[2*i+1]) != expected[i];
+        total += expected[i];
+    }
+    printf("Wavelet Count: %f seconds\n", elapsed_seconds(t));
+
+    t = clock();
+    for (i=0; i<queries; i++) {
+        errors += count_range_tree(rt, query_points[2*i], query_points[2*i+1], 1) != expected[i];
+    }
+    printf("Range Tree Count: %f seconds\n", elapsed_seconds(t));
+
+    t = clock();
+    for (i=0; i<queries; i++) {
+        Point **found = wavelet_query(wi, query_points[2*i], query_points[2*i+1]);
+        int found_size = 0;
+        while (found != NULL && found[found_size] != NULL) {
+            errors += !point_in_box(found[found_size], query_points[2*i], query_points[2*i+1], dimensions);
+            found_size++;
+        }
+        errors += found_size != expected[i];
+        free(found);
+    }
+    printf("Wavelet Report: %f seconds, %ld points\n", elapsed_seconds(t), total);
+    print_bench_result("Wavelet Index", errors);
+
+    free(expected);
+    free_wavelet_index(wi);
+    free_range_tree(rt);
+    free_points(query_points, 2*queries);
+    free_points(points, size);
+}
+
+
+void test_wavelet_index(void) {
+    bench_wavelet_index(100000, 2, 1000);
+    bench_wavelet_index(20000, 3, 1000);
+}
+
+/*
+ * Query planner
+ *
+ * The range tree fixes the order dimensions are descended in when it is
+ * built. The planner keeps a few trees built with different orders (plan i
+ * descends dimension i first) plus an equi-depth histogram per dimension.
+ * Each query is costed against every plan using the estimated number of
+ * points that survive each level, and queries whose estimated result is a
+ * large fraction of the points are answered with a filtered scan instead.
+ *
+ * planner_count and planner_query record every decision in the planner's
+ * stats without locking, so a planner must only be used from one thread.
+ */
+
+#define HISTOGRAM_BUCKETS 64
+#define SCAN_FRACTION 0.5
+
+
+typedef struct histogram {
+    int size;
+    int buckets;
+    int *bounds; //buckets+1 quantiles, bounds[0] is the min and bounds[buckets] the max
+}Histogram;
+
+
+typedef struct plannerStats {
+    long queries;
+    long scans;
+    long *plan_uses;
+    double estimated_cost; //summed estimated cost of the chosen plans
+    double default_cost; //summed estimated cost of always using plan 0
+}PlannerStats;
+
+
+typedef struct queryPlanner {
+    int size;
+    int dimensions;
+    Point **points;
+    Histogram *histograms;
+    int plan_count;
+    int **orders;
+    RangeTree **trees;
+    double scan_fraction;
+    PlannerStats stats;
+}QueryPlanner;
+
+
+void build_histogram(Histogram *h, Point **points, int size, int dimension) {
+    int *values = malloc(sizeof(int)*size);
+    int i;
+    for (i=0; i<size; i++) {
+        values[i] = points[i]->components[dimension-1];
+    }
+    qsort(values, size, sizeof(int), compare_ints);
+
+    h->size = size;
+    h->buckets = HISTOGRAM_BUCKETS;
+    h->bounds = malloc(sizeof(int)*(h->buckets+1));
+    for (i=0; i<=h->buckets; i++) {
+        h->bounds[i] = size == 0 ? 0 : values[(long)i * (size-1) / h->buckets];
+    }
+
+    free(values);
+}
+
+
+//estimated fraction of points with a value < value
+double histogram_fraction_below(Histogram *h, long value) {
+    if (value <= h->bounds[0]) {
+        return 0.0;
+    }
+    if (value > h->bounds[h->buckets]) {
+        return 1.0;
+    }
+
+    //last bucket with a lower bound < value
+    int k = lower_bound_int(h->bounds, h->buckets+1, value) - 1;
+    double within = (double)(value - h->bounds[k]) / (h->bounds[k+1] - h->bounds[k]);
+
+    return (k + within) / h->buckets;
+}
+
+
+double estimate_selectivity(Histogram *h, Point *first_bound, Point *second_bound, int dimension) {
+    long lower_bound = min(first_bound->components[dimension-1], second_bound->components[dimension-1]);
+    long upper_bound = max(first_bound->components[dimension-1], second_bound->components[dimension-1]);
+
+    return histogram_fraction_below(h, upper_bound+1) - histogram_fraction_below(h, lower_bound);
+}
+
+
+//sum over levels of the estimated points still in the box after that level
+double estimate_plan_cost(QueryPlanner *qp, double *selectivity, int *order) {
+    double cost = 0.0;
+    double remaining = qp->size;
+    int level;
+    for (level = 0; level < qp->dimensions; level++) {
+        remaining *= selectivity[order[level]];
+        cost += remaining;
+    }
+
+    return cost;
+}
+
+
+//plan_count trees are built, plan i descends dimension i first
+//(dimensions are rotated so every dimension keeps the same successor)
+QueryPlanner *build_query_planner(Point **points, int size, int dimensions, int plan_count) {
+    QueryPlanner *qp = malloc(sizeof(QueryPlanner));
+    qp->size = size;
+    qp->dimensions = dimensions;
+    qp->plan_count = max(1, min(plan_count, dimensions));
+    qp->scan_fraction = SCAN_FRACTION;
+
+    qp->points = malloc(sizeof(Point*)*size);
+    memcpy(qp->points, points, sizeof(Point*)*size);
+
+    qp->histograms = malloc(sizeof(Histogram)*dimensions);
+    int i;
+    for (i=0; i<dimensions; i++) {
+        build_histogram(&qp->histograms[i], points, size, i+1);
+    }
+
+    qp->orders = malloc(sizeof(int*)*qp->plan_count);
+    qp->trees = malloc(sizeof(RangeTree*)*qp->plan_count);
+    for (i=0; i<qp->plan_count; i++) {
+        qp->orders[i] = malloc(sizeof(int)*dimensions);
+        int level;
+        for (level = 0; level < dimensions; level++) {
+            qp->orders[i][level] = (i + level) % dimensions;
+        }
+
+        qp->trees[i] = build_range_tree_copy(points, size, dimensions, qp->orders[i], NULL);
+    }
+
+    qp->stats.queries = 0;
+    qp->stats.scans = 0;
+    qp->stats.plan_uses = calloc(qp->plan_count, sizeof(long));
+    qp->stats.estimated_cost = 0.0;
+    qp->stats.default_cost = 0.0;
+
+    return qp;
+}
+
+
+//returns the plan to use, or -1 for a filtered scan, and records the decision
+int choose_plan(QueryPlanner *qp, Point *first_bound, Point *second_bound, int allow_scan) {
+    double selectivity[qp->dimensions];
+    double result_fraction = 1.0;
+    int i;
+    for (i=0; i<qp->dimensions; i++) {
+        selectivity[i] = estimate_selectivity(&qp->histograms[i], first_bound, second_bound, i+1);
+        result_fraction *= selectivity[i];
+    }
+
+    double default_cost = estimate_plan_cost(qp, selectivity, qp->orders[0]);
+    int best = 0;
+    double best_cost = default_cost;
+    for (i=1; i<qp->plan_count; i++) {
+        double cost = estimate_plan_cost(qp, selectivity, qp->orders[i]);
+        if (cost < best_cost) {
+            best = i;
+            best_cost = cost;
+        }
+    }
+
+    //a scan touches every point once
+    if (allow_scan && result_fraction >= qp->scan_fraction) {
+        best = -1;
+        best_cost = qp->size;
+    }
+
+    qp->stats.queries++;
+    if (best == -1) {
+        qp->stats.scans++;
+    } else {
+        qp->stats.plan_uses[best]++;
+    }
+    qp->stats.estimated_cost += best_cost;
+    qp->stats.default_cost += default_cost;
+
+    return best;
+}
+
+
+int planner_count(QueryPlanner *qp, Point *first_bound, Point *second_bound) {
+    //counting never benefits from a scan
+    int plan = choose_plan(qp, first_bound, second_bound, 0);
+    return count_range_tree(qp->trees[plan], first_bound, second_bound, 1);
+}
+
+
+//returns NULL-TERMINATED list of points in the box, NULL if there are none
+Point **planner_query(QueryPlanner *qp, Point *first_bound, Point *second_bound) {
+    int plan = choose_plan(qp, first_bound, second_bound, 1);
+    Point **result;
+
+    //one pass into room for every point, then trimmed to the matches
+    if (plan == -1) {
+        result = malloc(sizeof(Point*)*(qp->size+1));
+        int i, found = 0;
+        for (i=0; i<qp->size; i++) {
+            if (point_in_box(qp->points[i], first_bound, second_bound, qp->dimensions)) {
+                result[found++] = qp->points[i];
+            }
+        }
+        if (found == 0) {
+            free(result);
+            return NULL;
+        }
+        result[found] = NULL;
+        return realloc(result, sizeof(Point*)*(found+1));
+    }
+
+    int count = count_range_tree(qp->trees[plan], first_bound, second_bound, 1);
+    if (count == 0) {
+        return NULL;
+    }
+    result = calloc(count+1, sizeof(Point*));
+    report_range_tree(qp->trees[plan], first_bound, second_bound, 1, result, 0);
+
+    return result;
+}
+
+
+void print_planner_stats(QueryPlanner *qp) {
+    PlannerStats *stats = &qp->stats;
+    printf("Planner: %ld queries, %ld scans\n", stats->queries, stats->scans);
+    int i;
+    for (i=0; i<qp->plan_count; i++) {
+        printf("Plan %d (dimension %d first): %ld queries\n", i, qp->orders[i][0]+1, stats->plan_uses[i]);
+    }
+    printf("Estimated cost: %.0f chosen vs %.0f default (%.1f%% saved)\n",
+           stats->estimated_cost, stats->default_cost,
+           stats->default_cost > 0 ? 100.0 * (1.0 - stats->estimated_cost / stats->default_cost) : 0.0);
+}
+
+
+void free_query_planner(QueryPlanner *qp) {
+    int i;
+    for (i=0; i<qp->plan_count; i++) {
+        free_range_tree(qp->trees[i]);
+        free(qp->orders[i]);
+    }
+    for (i=0; i<qp->dimensions; i++) {
+        free(qp->histograms[i].bounds);
+    }
+    free(qp->trees);
+    free(qp->orders);
+    free(qp->histograms);
+    free(qp->stats.plan_uses);
+    free(qp->points);
+    free(qp);
+}
+
+
+//queries are narrow (1%) in one random dimension and wide (90%) in the rest
+void bench_query_planner(int size, int dimensions, int queries) {
+    printf("Query Planner: %d points, %d dimensions, %d queries\n", size, dimensions, queries);
+    Point **points = generate_random(size, dimensions);
+    Point **query_points = generate_random(2*queries, dimensions);
+
+    int i, j;
+    for (i=0; i<queries; i++) {
+        int narrow = rand() % dimensions;
+        for (j=0; j<dimensions; j++) {
+            int width = j == narrow ? 10000 : 900000;
+            int start = rand() % (1000000 - width);
+            query_points[2*i]->components[j] = start;
+            query_points[2*i+1]->components[j] = start + width;
+        }
+    }
+
+    clock_t t = clock();
+    QueryPlanner *qp = build_query_planner(points, size, dimensions, dimensions);
+    printf("Planner Build: %f seconds\n", elapsed_seconds(t));
+
+    int *expected = brute_force_counts(points, size, dimensions, query_points, queries);
+    int errors = 0;
+    t = clock();
+    for (i=0; i<queries; i++) {
+        errors += count_range_tree(qp->trees[0], query_points[2*i], query_points[2*i+1], 1) != expected[i];
+    }
+    printf("Fixed Order Count: %f seconds\n", elapsed_seconds(t));
+
+    t = clock();
+    for (i=0; i<queries; i++) {
+        errors += planner_count(qp, query_points[2*i], query_points[2*i+1]) != expected[i];
+    }
+    printf("Planned Count: %f seconds\n", elapsed_seconds(t));
+
+    t = clock();
+    for (i=0; i<queries; i++) {
+        Point **found = calloc(expected[i]+1, sizeof(Point*));
+        errors += report_range_tree(qp->trees[0], query_points[2*i], query_points[2*i+1], 1, found, 0) != expected[i];
+        free(found);
+    }
+    printf("Fixed Order Report: %f seconds\n", elapsed_seconds(t));
+
+    t = clock();
+    for (i=0; i<queries; i++) {
+        Point **found = planner_query(qp, query_points[2*i], query_points[2*i+1]);
+        int found_size = 0;
+        while (found != NULL && found[found_size] != NULL) {
+            errors += !point_in_box(found[found_size], query_points[2*i], query_points[2*i+1], dimensions);
+            found_size++;
+        }
+        errors += found_size != expected[i];
+        free(found);
+    }
+    printf("Planned Report: %f seconds\n", elapsed_seconds(t));
+
+    //a box covering nearly everything should be scanned
+    for (j=0; j<dimensions; j++) {
+        query_points[0]->components[j] = 0;
+        query_points[1]->components[j] = 1000000;
+    }
+    Point **found = planner_query(qp, query_points[0], query_points[1]);
+    for (i=0; found != NULL && found[i] != NULL; i++);
+    errors += i != size;
+    free(found);
+
+    print_planner_stats(qp);
+    print_bench_result("Query Planner", errors);
+
+    free(expected);
+    free_query_planner(qp);
+    free_points(query_points, 2*queries);
+    free_points(points, size);
+}
+
+
+void test_query_planner(void) {
+    bench_query_planner(10000, 3, 1000);
+}
+
+
+//constrains k of the dimensions for every k, wildcard boxes against INT_MIN/INT_MAX sentinels
+void bench_partial_box(int size, int dimensions, int queries) {
+    printf("Partial Boxes: %d points, %d dimensions, %d queries\n", size, dimensions, queries);
+    Point **points = generate_random(size, dimensions);
+    RangeTree *rt = build_range_tree_copy(points, size, dimensions, NULL, NULL);
+
+    QueryBox **boxes = malloc(sizeof(QueryBox*)*queries);
+    QueryBox **sentinel_boxes = malloc(sizeof(QueryBox*)*queries);
+    Point **found = malloc(sizeof(Point*)*(size+1));
+    int errors = 0;
+
+    int constrained;
+    for (constrained = 1; constrained <= dimensions; constrained++) {
+        int i, j;
+        for (i=0; i<queries; i++) {
+            boxes[i] = create_query_box(dimensions);
+            sentinel_boxes[i] = create_query_box(dimensions);
+
+            //first constrained dimension is random, the rest follow it
+            int first = rand() % dimensions;
+            for (j=0; j<dimensions; j++) {
+                int dimension = (first + j) % dimensions + 1;
+                if (j >= constrained) {
+                    box_set_range(sentinel_boxes[i], dimension, INT_MIN, INT_MAX);
+                } else if (j == 1) {
+                    //one sided
+                    int bound = rand() % 1000000;
+                    box_set_lower(boxes[i], dimension, bound);
+                    box_set_lower(sentinel_boxes[i], dimension, bound);
+                    box_set_upper(sentinel_boxes[i], dimension, INT_MAX);
+                } else {
+                    int start = rand() % 500000;
+                    box_set_range(boxes[i], dimension, start, start + 500000);
+                    box_set_range(sentinel_boxes[i], dimension, start, start + 500000);
+                }
+            }
+        }
+
+        int *expected = calloc(queries, sizeof(int));
+        for (i=0; i<queries; i++) {
+            for (j=0; j<size; j++) {
+                expected[i] += point_in_query_box(points[j], boxes[i]);
+            }
+        }
+
+        clock_t t = clock();
+        for (i=0; i<queries; i++) {
+            errors += count_box(rt, sentinel_boxes[i], 1) != expected[i];
+        }
+        double sentinel_count = elapsed_seconds(t);
+
+        t = clock();
+        for (i=0; i<queries; i++) {
+            errors += count_box(rt, boxes[i], 1) != expected[i];
+        }
+        double box_count = elapsed_seconds(t);
+
+        t = clock();
+        for (i=0; i<queries; i++) {
+            errors += report_box(rt, sentinel_boxes[i], 1, found, 0) != expected[i];
+        }
+        double sentinel_report = elapsed_seconds(t);
+
+        t = clock();
+        for (i=0; i<queries; i++) {
+            errors += report_box(rt, boxes[i], 1, found, 0) != expected[i];
+        }
+        double box_report = elapsed_seconds(t);
+
+        for (i=0; i<queries; i++) {
+            int found_size = report_box(rt, boxes[i], 1, found, 0);
+            for (j=0; j<found_size; j++) {
+                errors += !point_in_query_box(found[j], boxes[i]);
+            }
+        }
+
+        printf("%d constrained: count %f vs %f sentinel, report %f vs %f sentinel seconds\n",
+               constrained, box_count, sentinel_count, box_report, sentinel_report);
+
+        for (i=0; i<queries; i++) {
+            free_query_box(boxes[i]);
+            free_query_box(sentinel_boxes[i]);
+        }
+        free(expected);
+    }
+
+    print_bench_result("Partial Box", errors);
+
+    free(found);
+    free(boxes);
+    free(sentinel_boxes);
+    free_range_tree(rt);
+    free_points(points, size);
+}
+
+
+void test_partial_box(void) {
+    bench_partial_box(600, 5, 1000);
+}
+
+
+int tree_depth(Node *root) {
+    if (root == NULL) {
+        return 0;
+    }
+
+    return 1 + max(tree_depth(root->left_child), tree_depth(root->right_child));
+}
+
+
+//sorts and builds on data with only a few distinct keys per dimension
+void bench_duplicate_build(int size, int dimensions, int distinct) {
+    printf("Duplicate Build: %d points, %d dimensions, %d distinct keys\n", size, dimensions, distinct);
+    Point **points = generate_duplicates(size, dimensions, distinct);
+    int errors = 0;
+
+    clock_t t = clock();
+    sort(points, 0, size, 1);
+    printf("Sort: %f seconds\n", elapsed_seconds(t));
+    errors += !check_sorted(points, size, 0);
+
+    t = clock();
+    RangeTree *rt = build_range_tree_copy(points, size, dimensions, NULL, NULL);
+    printf("Build: %f seconds, %ld bytes\n", elapsed_seconds(t), range_tree_bytes(rt));
+
+    int depth = tree_depth(rt->root);
+    int log_size = 0;
+    int n;
+    for (n = size; n > 1; n = (n+1)/2) {
+        log_size++;
+    }
+    printf("Depth: %d (log2 n = %d)\n", depth, log_size);
+    errors += depth > log_size + 1;
+    errors += !check_range_tree_ordering(rt->root, 1, dimensions);
+
+    Point **query_points = generate_duplicates(2, dimensions, distinct);
+    int i;
+    for (i=0; i<100; i++) {
+        int j;
+        for (j=0; j<dimensions; j++) {
+            query_points[0]->components[j] = rand() % distinct;
+            query_points[1]->components[j] = rand() % distinct;
+        }
+        errors += count_range_tree(rt, query_points[0], query_points[1], 1) !=
+                  count_brute_force(points, size, dimensions, query_points[0], query_points[1]);
+    }
+
+    print_bench_result("Duplicate Build", errors);
+
+    free_range_tree(rt);
+    free_points(query_points, 2);
+    free_points(points, size);
+}
+
+
+void test_duplicate_build(void) {
+    bench_duplicate_build(1000000, 1, 4);
+    bench_duplicate_build(100000, 2, 16);
+    bench_duplicate_build(20000, 3, 8);
+}
+
+
+//one copy of the tree per NUMA node, each bound to its node
+typedef struct replicatedTree {
+    int replicas;
+    RangeTree **trees;
+}ReplicatedTree;
+
+
+ReplicatedTree *build_replicated_range_tree(Point **points, int size, int dimensions, int hugepages) {
+    ReplicatedTree *replicated = malloc(sizeof(ReplicatedTree));
+    replicated->replicas = numa_node_count();
+    replicated->trees = malloc(sizeof(RangeTree*)*replicated->replicas);
+
+    int node;
+    for (node = 0; node < replicated->replicas; node++) {
+        Arena *arena = create_arena(hugepages, ARENA_NUMA_BIND, node);
+        replicated->trees[node] = build_range_tree_copy(points, size, dimensions, NULL, arena);
+    }
+
+    return replicated;
+}
+
+
+//replica on the node the calling thread is running on, pin the thread first
+RangeTree *local_replica(ReplicatedTree *replicated) {
+    int node = current_numa_node();
+    if (node < 0 || node >= replicated->replicas) {
+        node = 0;
+    }
+
+    return replicated->trees[node];
+}
+
+
+void free_replicated_range_tree(ReplicatedTree *replicated) {
+    int i;
+    for (i=0; i<replicated->replicas; i++) {
+        free_range_tree(replicated->trees[i]);
+    }
+    free(replicated->trees);
+    free(replicated);
+}
+
+
+//counts data TLB read misses of the calling thread, -1 if unavailable
+int open_tlb_counter(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+//times count queries, adding the TLB misses to *tlb_misses when the counter is open
+double time_counts(RangeTree *rt, Point **query_points, int queries, int *expected,
+                   int tlb_counter, long *tlb_misses, int *errors) {
+    if (tlb_counter >= 0) {
+        ioctl(tlb_counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(tlb_counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    clock_t t = clock();
+    int i;
+    for (i=0; i<queries; i++) {
+        *errors += count_range_tree(rt, query_points[2*i], query_points[2*i+1], 1) != expected[i];
+    }
+    double seconds = elapsed_seconds(t);
+
+    *tlb_misses = -1;
+    if (tlb_counter >= 0) {
+        ioctl(tlb_counter, PERF_EVENT_IOC_DISABLE, 0);
+        long long misses;
+        if (read(tlb_counter, &misses, sizeof(misses)) == sizeof(misses)) {
+            *tlb_misses = misses;
+        }
+    }
+
+    return seconds;
+}
+
+
+//malloc placed tree against hugepage arenas and per node replicas
+void bench_index_memory(int size, int dimensions, int queries) {
+    printf("Index Memory: %d points, %d dimensions, %d queries\n", size, dimensions, queries);
+    Point **points = generate_random(size, dimensions);
+    Point **query_points = generate_random(2*queries, dimensions);
+    int errors = 0;
+    int *expected = brute_force_counts(points, size, dimensions, query_points, queries);
+
+    int tlb_counter = open_tlb_counter();
+    if (tlb_counter < 0) {
+        printf("TLB miss counter unavailable\n");
+    }
+    long tlb_misses;
+
+    clock_t t = clock();
+    RangeTree *rt = build_range_tree_copy(points, size, dimensions, NULL, NULL);
+    printf("malloc Build: %f seconds\n", elapsed_seconds(t));
+    double seconds = time_counts(rt, query_points, queries, expected, tlb_counter, &tlb_misses, &errors);
+    printf("malloc Count: %f seconds, %ld TLB misses\n", seconds, tlb_misses);
+    free_range_tree(rt);
+
+    int hugepages[] = {ARENA_PAGES_NONE, ARENA_PAGES_TRANSPARENT, ARENA_PAGES_EXPLICIT};
+    const char *names[] = {"small page", "transparent hugepage", "explicit hugepage"};
+    int h;
+    for (h=0; h<3; h++) {
+        Arena *arena = create_arena(hugepages[h], ARENA_NUMA_INTERLEAVE, -1);
+        t = clock();
+        rt = build_range_tree_copy(points, size, dimensions, NULL, arena);
+        //every chunk fell back to transparent hugepages, which the previous run already measured
+        if (hugepages[h] == ARENA_PAGES_EXPLICIT && arena->stats.explicit_chunks == 0) {
+            printf("%s arena skipped: no 2MB hugepages reserved\n", names[h]);
+            free_range_tree(rt);
+            continue;
+        }
+        printf("%s arena Build: %f seconds\n", names[h], elapsed_seconds(t));
+        seconds = time_counts(rt, query_points, queries, expected, tlb_counter, &tlb_misses, &errors);
+        printf("%s arena Count: %f seconds, %ld TLB misses\n", names[h], seconds, tlb_misses);
+        print_arena_stats(arena);
+        free_range_tree(rt);
+    }
+
+    ReplicatedTree *replicated = build_replicated_range_tree(points, size, dimensions, ARENA_PAGES_TRANSPARENT);
+    cpu_set_t saved_cpus;
+    int restore_cpus = sched_getaffinity(0, sizeof(saved_cpus), &saved_cpus) == 0;
+    int node;
+    for (node = 0; node < replicated->replicas; node++) {
+        if (pin_to_numa_node(node) != 0) {
+            printf("Could not pin to node %d\n", node);
+            continue;
+        }
+        seconds = time_counts(local_replica(replicated), query_points, queries, expected,
+                              tlb_counter, &tlb_misses, &errors);
+        printf("Node %d local replica Count: %f seconds, %ld TLB misses\n", node, seconds, tlb_misses);
+    }
+    if (restore_cpus) {
+        sched_setaffinity(0, sizeof(saved_cpus), &saved_cpus);
+    }
+    free_replicated_range_tree(replicated);
+
+    if (tlb_counter >= 0) {
+        close(tlb_counter);
+    }
+
+    print_bench_result("Index Memory", errors);
+
+    free(expected);
+    free_points(query_points, 2*queries);
+    free_points(points, size);
+}
+
+
+void test_index_memory(void) {
+    bench_index_memory(20000, 3, 2000);
+}
+
+
+//latency and accuracy of approximate counts over large boxes for several epsilons
+void bench_approx_count(int size, int dimensions, int queries) {
+    printf("Approximate Count: %d points, %d dimensions, %d queries\n", size, dimensions, queries);
+    Point **points = generate_random(size, dimensions);
+    RangeTree *rt = build_range_tree_copy(points, size, dimensions, NULL, NULL);
+
+    //boxes cover 40% to 90% of each dimension
+    QueryBox **boxes = malloc(sizeof(QueryBox*)*queries);
+    int i, j;
+    for (i=0; i<queries; i++) {
+        boxes[i] = create_query_box(dimensions);
+        for (j=0; j<dimensions; j++) {
+            int width = 400000 + rand() % 500000;
+            int start = rand() % (1000000 - width);
+            box_set_range(boxes[i], j+1, start, start + width);
+        }
+    }
+
+    int *exact = malloc(sizeof(int)*queries);
+    clock_t t = clock();
+    for (i=0; i<queries; i++) {
+        exact[i] = count_box(rt, boxes[i], 1);
+    }
+    printf("Exact: %f seconds\n", elapsed_seconds(t));
+
+    int errors = 0;
+    double fractions[] = {0.0, 0.001, 0.01, 0.05, 0.1};
+    int f;
+    for (f=0; f<5; f++) {
+        double epsilon = fractions[f] * size;
+        ApproxCount *results = malloc(sizeof(ApproxCount)*queries);
+
+        t = clock();
+        for (i=0; i<queries; i++) {
+            results[i] = approx_count_box(rt, boxes[i], epsilon);
+        }
+        double seconds = elapsed_seconds(t);
+
+        double total_error = 0.0, max_error = 0.0;
+        long sampled = 0;
+        int within = 0;
+        for (i=0; i<queries; i++) {
+            double error = fabs(results[i].estimate - exact[i]);
+            total_error += error;
+            max_error = error > max_error ? error : max_error;
+            within += error <= results[i].confidence_half_width + 1e-9;
+            sampled += results[i].sampled_nodes;
+            errors += results[i].confidence_half_width > epsilon + 1e-9;
+            if (epsilon == 0.0) {
+                errors += error > 0.0;
+            }
+        }
+
+        printf("epsilon %.0f: %f seconds, mean error %.1f, max error %.1f, %.1f%% within half-width, %.1f sampled nodes\n",
+               epsilon, seconds, total_error / queries, max_error, 100.0 * within / queries,
+               (double)sampled / queries);
+        free(results);
+    }
+
+    print_bench_result("Approximate Count", errors);
+
+    for (i=0; i<queries; i++) {
+        free_query_box(boxes[i]);
+    }
+    free(boxes);
+    free(exact);
+    free_range_tree(rt);
+    free_points(points, size);
+}
+
+
+void test_approx_count(void) {
+    bench_approx_count(20000, 3, 1000);
+}
+
 
+//lrt_server.c includes this file and brings its own main
+#ifndef LRT_NO_MAIN
 int main(void) {
 
     /*
@@ -807,8 +3187,15 @@ int main(void) {
     */
 
     //test_range_tree_construction();
+    //test_wavelet_index();
+    //test_query_planner();
+    //test_partial_box();
+    //test_duplicate_build();
+    //test_index_memory();
+    //test_approx_count();
     
     test_random_query();
 
     return 0;
 }
+#endif
@@ -0,0 +1,337 @@
+//Load generator for lrt_server: reports QPS and latency percentiles
+//usage: lrt_loadgen -s SOCKET [-c CONNECTIONS] [-p PIPELINE] [-r REQUESTS] [-t count|query|batch]
+//                   [-b BATCH_SIZE] [-k CONSTRAINED_DIMENSIONS] [-w WIDTH]
+//each connection runs on its own thread and keeps PIPELINE requests in flight,
+//boxes constrain k random dimensions to a range of WIDTH within [0, 1000000)
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "lrt_protocol.h"
+
+
+typedef struct loadConfig {
+    const char *socket_path;
+    int connections;
+    int pipeline;
+    int requests; //per connection
+    int type;
+    int batch_size;
+    int constrained;
+    int width;
+    int dimensions; //from the server's INFO response
+}LoadConfig;
+
+
+typedef struct client {
+    LoadConfig *config;
+    unsigned int seed;
+    double *latencies; //microseconds, one per request
+    long results; //points or counts returned, keeps the work honest
+    int errors;
+}Client;
+
+
+double now_microseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+int connect_server(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+//returns 0 for failure, 1 for success
+int write_all(int fd, const void *data, size_t size) {
+    const char *p = data;
+    while (size > 0) {
+        ssize_t written = write(fd, p, size);
+        if (written <= 0) {
+            return 0;
+        }
+        p += written;
+        size -= written;
+    }
+
+    return 1;
+}
+
+
+//returns 0 for failure, 1 for success
+int read_all(int fd, void *data, size_t size) {
+    char *p = data;
+    while (size > 0) {
+        ssize_t got = read(fd, p, size);
+        if (got <= 0) {
+            return 0;
+        }
+        p += got;
+        size -= got;
+    }
+
+    return 1;
+}
+
+
+void random_box(Client *client, LrtBound *bounds) {
+    LoadConfig *config = client->config;
+    memset(bounds, 0, sizeof(LrtBound) * config->dimensions);
+
+    int first = rand_r(&client->seed) % config->dimensions;
+    int i;
+    for (i=0; i<config->constrained && i<config->dimensions; i++) {
+        LrtBound *bound = &bounds[(first + i) % config->dimensions];
+        bound->constraint = LRT_BOUND_LOWER | LRT_BOUND_UPPER;
+        bound->lower = rand_r(&client->seed) % (1000000 - config->width);
+        bound->upper = bound->lower + config->width;
+    }
+}
+
+
+//returns 0 for failure, 1 for success
+int send_request(Client *client, int fd, uint32_t request_id, char *message) {
+    LoadConfig *config = client->config;
+    LrtHeader *header = (LrtHeader*)message;
+    memset(header, 0, sizeof(LrtHeader));
+    header->request_id = request_id;
+    header->type = config->type;
+
+    char *payload = message + sizeof(LrtHeader);
+    int boxes = 1;
+    if (config->type == LRT_REQUEST_BATCH) {
+        uint32_t n = config->batch_size;
+        memcpy(payload, &n, sizeof(n));
+        payload += sizeof(n);
+        boxes = config->batch_size;
+    }
+
+    int i;
+    for (i=0; i<boxes; i++) {
+        random_box(client, (LrtBound*)payload);
+        payload += sizeof(LrtBound) * config->dimensions;
+    }
+
+    header->length = payload - message - sizeof(LrtHeader);
+    return write_all(fd, message, payload - message);
+}
+
+
+void *client_main(void *arg) {
+    Client *client = arg;
+    LoadConfig *config = client->config;
+
+    int fd = connect_server(config->socket_path);
+    if (fd < 0) {
+        client->errors = config->requests;
+        return NULL;
+    }
+
+    size_t message_size = sizeof(LrtHeader) + sizeof(uint32_t) +
+                          sizeof(LrtBound) * config->dimensions * config->batch_size;
+    char *message = malloc(message_size);
+    double *sent = malloc(sizeof(double) * config->requests);
+    char *response = NULL;
+    size_t response_capacity = 0;
+
+    int next = 0, received = 0;
+    while (received < config->requests) {
+        //fill the pipeline
+        while (next < config->requests && next - received < config->pipeline) {
+            sent[next] = now_microseconds();
+            if (!send_request(client, fd, next, message)) {
+                client->errors += config->requests - received;
+                goto done;
+            }
+            next++;
+        }
+
+        LrtHeader header;
+        if (!read_all(fd, &header, sizeof(header))) {
+            client->errors += config->requests - received;
+            goto done;
+        }
+        if (header.length > response_capacity) {
+            response_capacity = header.length;
+            response = realloc(response, response_capacity);
+        }
+        if (!read_all(fd, response, header.length)) {
+            client->errors += config->requests - received;
+            goto done;
+        }
+
+        if (header.type != LRT_STATUS_OK || header.request_id >= (uint32_t)config->requests) {
+            client->errors++;
+        } else {
+            client->latencies[received] = now_microseconds() - sent[header.request_id];
+            int32_t first;
+            memcpy(&first, response, sizeof(first));
+            client->results += first;
+        }
+        received++;
+    }
+
+done:
+    free(response);
+    free(sent);
+    free(message);
+    close(fd);
+
+    return NULL;
+}
+
+
+int compare_doubles(const void *first, const void *second) {
+    double a = *(const double*)first;
+    double b = *(const double*)second;
+    return (a > b) - (a < b);
+}
+
+
+double percentile(double *sorted, long size, double fraction) {
+    long index = (long)(fraction * (size - 1));
+    return sorted[index];
+}
+
+
+//asks the server for its dimensions, returns 0 for failure
+int fetch_info(LoadConfig *config) {
+    int fd = connect_server(config->socket_path);
+    if (fd < 0) {
+        return 0;
+    }
+
+    LrtHeader header;
+    memset(&header, 0, sizeof(header));
+    header.type = LRT_REQUEST_INFO;
+    int32_t info[2];
+    int ok = write_all(fd, &header, sizeof(header)) && read_all(fd, &header, sizeof(header)) &&
+             header.type == LRT_STATUS_OK && header.length == sizeof(info) && read_all(fd, info, sizeof(info));
+    close(fd);
+
+    if (ok) {
+        config->dimensions = info[1];
+        printf("Server has %d points in %d dimensions\n", info[0], info[1]);
+    }
+
+    return ok;
+}
+
+
+int main(int argc, char **argv) {
+    LoadConfig config;
+    config.socket_path = NULL;
+    config.connections = 4;
+    config.pipeline = 16;
+    config.requests = 10000;
+    config.type = LRT_REQUEST_COUNT;
+    config.batch_size = 16;
+    config.constrained = 2;
+    config.width = 100000;
+
+    int option;
+    while ((option = getopt(argc, argv, "s:c:p:r:t:b:k:w:")) != -1) {
+        switch (option) {
+            case 's': config.socket_path = optarg; break;
+            case 'c': config.connections = atoi(optarg); break;
+            case 'p': config.pipeline = atoi(optarg); break;
+            case 'r': config.requests = atoi(optarg); break;
+            case 't':
+                config.type = strcmp(optarg, "query") == 0 ? LRT_REQUEST_QUERY :
+                              strcmp(optarg, "batch") == 0 ? LRT_REQUEST_BATCH : LRT_REQUEST_COUNT;
+                break;
+            case 'b': config.batch_size = atoi(optarg); break;
+            case 'k': config.constrained = atoi(optarg); break;
+            case 'w': config.width = atoi(optarg); break;
+            default:
+                printf("usage: %s -s SOCKET [-c CONNECTIONS] [-p PIPELINE] [-r REQUESTS] "
+                       "[-t count|query|batch] [-b BATCH_SIZE] [-k CONSTRAINED] [-w WIDTH]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (config.socket_path == NULL || config.connections <= 0 || config.pipeline <= 0 ||
+        config.requests <= 0 || config.batch_size <= 0 || config.width <= 0 || config.width >= 1000000) {
+        printf("usage: %s -s SOCKET [-c CONNECTIONS] [-p PIPELINE] [-r REQUESTS] "
+               "[-t count|query|batch] [-b BATCH_SIZE] [-k CONSTRAINED] [-w WIDTH]\n", argv[0]);
+        return 1;
+    }
+    if (!fetch_info(&config)) {
+        printf("Could not reach server\n");
+        return 1;
+    }
+
+    Client *clients = calloc(config.connections, sizeof(Client));
+    pthread_t *threads = malloc(sizeof(pthread_t) * config.connections);
+
+    double start = now_microseconds();
+    int i;
+    for (i=0; i<config.connections; i++) {
+        clients[i].config = &config;
+        clients[i].seed = time(NULL) + i;
+        clients[i].latencies = calloc(config.requests, sizeof(double));
+        pthread_create(&threads[i], NULL, client_main, &clients[i]);
+    }
+    for (i=0; i<config.connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = (now_microseconds() - start) / 1e6;
+
+    //failed requests leave a zero latency behind, drop them
+    long total = (long)config.connections * config.requests;
+    double *latencies = malloc(sizeof(double) * total);
+    long completed = 0, results = 0;
+    int errors = 0;
+    for (i=0; i<config.connections; i++) {
+        int j;
+        for (j=0; j<config.requests; j++) {
+            if (clients[i].latencies[j] > 0) {
+                latencies[completed++] = clients[i].latencies[j];
+            }
+        }
+        results += clients[i].results;
+        errors += clients[i].errors;
+        free(clients[i].latencies);
+    }
+    qsort(latencies, completed, sizeof(double), compare_doubles);
+
+    printf("%ld requests in %f seconds over %d connections, pipeline %d: %.0f QPS\n",
+           completed, elapsed, config.connections, config.pipeline, completed / elapsed);
+    if (completed > 0) {
+        printf("Latency us: p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+               percentile(latencies, completed, 0.5), percentile(latencies, completed, 0.9),
+               percentile(latencies, completed, 0.99), percentile(latencies, completed, 0.999),
+               latencies[completed-1]);
+    }
+    printf("Results: %ld, errors: %d\n", results, errors);
+
+    free(latencies);
+    free(threads);
+    free(clients);
+
+    return errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,52 @@
+#ifndef LRT_PROTOCOL_H
+#define LRT_PROTOCOL_H
+
+#include <stdint.h>
+
+/*
+ * Binary protocol spoken by lrt_server over a unix domain socket.
+ *
+ * Every message is a header followed by a payload, all fields are native
+ * endian since both ends are on the same host. Requests may be pipelined,
+ * responses carry the request id and can come back out of order.
+ *
+ * Box:           dimensions * {int32 constraint, int32 lower, int32 upper}
+ *                (constraint uses the LRT_BOUND_* flags, unset bounds are ignored)
+ *
+ * COUNT  req:    box                      resp: int32 count
+ * QUERY  req:    box                      resp: uint32 n, n * dimensions int32
+ * BATCH  req:    uint32 n, n * box        resp: uint32 n, n * int32 count
+ * INFO   req:    (empty)                  resp: int32 size, int32 dimensions
+ */
+
+#define LRT_REQUEST_COUNT 1
+#define LRT_REQUEST_QUERY 2
+#define LRT_REQUEST_BATCH 3
+#define LRT_REQUEST_INFO 4
+
+//LrtBound.constraint bits
+#define LRT_BOUND_LOWER 1
+#define LRT_BOUND_UPPER 2
+
+#define LRT_STATUS_OK 0
+#define LRT_STATUS_BAD_REQUEST 1
+
+//requests larger than this are rejected and the connection closed
+#define LRT_MAX_MESSAGE (16 * 1024 * 1024)
+
+
+typedef struct lrtHeader {
+    uint32_t length; //payload bytes following the header
+    uint32_t request_id;
+    uint8_t type; //LRT_REQUEST_* in requests, LRT_STATUS_* in responses
+    uint8_t reserved[3];
+}LrtHeader;
+
+
+typedef struct lrtBound {
+    int32_t constraint;
+    int32_t lower;
+    int32_t upper;
+}LrtBound;
+
+#endif
@@ -0,0 +1,768 @@
+//Long running query server: builds the index once and serves it over a unix socket
+//usage: lrt_server -s SOCKET [-f POINTS_FILE | -n SIZE -d DIMENSIONS] [-w WORKERS]
+//POINTS_FILE is text: "size dimensions" followed by size*dimensions integers
+
+#define LRT_NO_MAIN
+#include "lrt.c"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "lrt_protocol.h"
+
+#define MAX_EVENTS 64
+#define READ_CHUNK 65536
+//requests parsed but not answered per connection before reading pauses
+#define MAX_PENDING 1024
+//unsent response bytes per connection before reading pauses
+#define MAX_UNSENT (4 * 1024 * 1024)
+//unparsed request bytes per connection, always room for one whole message
+#define MAX_UNPARSED (LRT_MAX_MESSAGE + sizeof(LrtHeader))
+
+
+typedef struct buffer {
+    char *data;
+    size_t start; //consumed bytes before this
+    size_t size;
+    size_t capacity;
+}Buffer;
+
+
+typedef struct connection {
+    int fd;
+    unsigned int generation; //tells completions for a reused fd apart
+    int pending;
+    int dirty; //has new output from the current batch of completions
+    uint32_t events; //currently registered with epoll
+    int read_closed; //client shut down its side, closed once everything is answered
+    Buffer in;
+    Buffer out;
+}Connection;
+
+
+typedef struct job {
+    int fd;
+    unsigned int generation;
+    LrtHeader header;
+    char *payload;
+    Buffer response;
+    struct job *next;
+}Job;
+
+
+typedef struct jobQueue {
+    Job *head;
+    Job *tail;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    int stopping;
+}JobQueue;
+
+
+typedef struct serverStats {
+    long connections;
+    long requests[LRT_REQUEST_INFO+1];
+    long bad_requests;
+}ServerStats;
+
+
+typedef struct server {
+    RangeTree *rt;
+    int size;
+    int dimensions;
+
+    int listen_fd;
+    int epoll_fd;
+    int event_fd; //workers signal finished jobs here
+    unsigned int generation;
+    Connection **connections; //indexed by fd
+    int connection_capacity;
+
+    JobQueue requests;
+    JobQueue completions;
+    pthread_t *workers;
+    int worker_count;
+
+    ServerStats stats;
+}Server;
+
+
+static volatile sig_atomic_t stop_requested = 0;
+
+
+void handle_stop(int signal_number) {
+    (void)signal_number;
+    stop_requested = 1;
+}
+
+
+void buffer_reserve(Buffer *b, size_t extra) {
+    if (b->size + extra <= b->capacity) {
+        return;
+    }
+
+    //slide unconsumed bytes to the front before growing
+    if (b->start > 0) {
+        memmove(b->data, b->data + b->start, b->size - b->start);
+        b->size -= b->start;
+        b->start = 0;
+        if (b->size + extra <= b->capacity) {
+            return;
+        }
+    }
+
+    size_t capacity = b->capacity == 0 ? 4096 : b->capacity;
+    while (capacity < b->size + extra) {
+        capacity *= 2;
+    }
+    b->data = realloc(b->data, capacity);
+    b->capacity = capacity;
+}
+
+
+void buffer_append(Buffer *b, const void *data, size_t size) {
+    buffer_reserve(b, size);
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+
+void buffer_free(Buffer *b) {
+    free(b->data);
+    b->data = NULL;
+    b->start = b->size = b->capacity = 0;
+}
+
+
+void queue_init(JobQueue *q) {
+    q->head = NULL;
+    q->tail = NULL;
+    q->stopping = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->ready, NULL);
+}
+
+
+void queue_push(JobQueue *q, Job *job) {
+    job->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == NULL) {
+        q->head = job;
+    } else {
+        q->tail->next = job;
+    }
+    q->tail = job;
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+}
+
+
+//blocks until a job is available, NULL once the queue is stopping
+Job *queue_pop(JobQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->head == NULL && !q->stopping) {
+        pthread_cond_wait(&q->ready, &q->lock);
+    }
+
+    Job *job = q->head;
+    if (job != NULL) {
+        q->head = job->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return job;
+}
+
+
+//takes every queued job at once
+Job *queue_drain(JobQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    Job *jobs = q->head;
+    q->head = NULL;
+    q->tail = NULL;
+    pthread_mutex_unlock(&q->lock);
+
+    return jobs;
+}
+
+
+void queue_stop(JobQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->stopping = 1;
+    pthread_cond_broadcast(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+}
+
+
+void free_job(Job *job) {
+    free(job->payload);
+    buffer_free(&job->response);
+    free(job);
+}
+
+
+//reads one box from payload, returns NULL if it runs past the end
+QueryBox *read_box(Server *server, char *payload, uint32_t length, uint32_t *offset) {
+    uint32_t needed = sizeof(LrtBound) * server->dimensions;
+    if (length < *offset || length - *offset < needed) {
+        return NULL;
+    }
+
+    QueryBox *box = create_query_box(server->dimensions);
+    int i;
+    for (i=0; i<server->dimensions; i++) {
+        LrtBound bound;
+        memcpy(&bound, payload + *offset + i*sizeof(LrtBound), sizeof(LrtBound));
+        if (bound.constraint & LRT_BOUND_LOWER) {
+            box_set_lower(box, i+1, bound.lower);
+        }
+        if (bound.constraint & LRT_BOUND_UPPER) {
+            box_set_upper(box, i+1, bound.upper);
+        }
+    }
+    *offset += needed;
+
+    return box;
+}
+
+
+//fills job->response with the header and payload for the request
+void handle_request(Server *server, Job *job) {
+    Buffer *out = &job->response;
+    LrtHeader header;
+    memset(&header, 0, sizeof(header));
+    header.request_id = job->header.request_id;
+    header.type = LRT_STATUS_OK;
+    buffer_append(out, &header, sizeof(header));
+
+    uint32_t length = job->header.length;
+    uint32_t offset = 0;
+    int ok = 1;
+
+    if (job->header.type == LRT_REQUEST_COUNT) {
+        QueryBox *box = read_box(server, job->payload, length, &offset);
+        if (box == NULL || offset != length) {
+            ok = 0;
+        } else {
+            int32_t count = count_box(server->rt, box, 1);
+            buffer_append(out, &count, sizeof(count));
+        }
+        if (box != NULL) {
+            free_query_box(box);
+        }
+    } else if (job->header.type == LRT_REQUEST_QUERY) {
+        QueryBox *box = read_box(server, job->payload, length, &offset);
+        if (box == NULL || offset != length) {
+            ok = 0;
+        } else {
+            uint32_t count = count_box(server->rt, box, 1);
+            Point **found = malloc(sizeof(Point*)*(count+1));
+            report_box(server->rt, box, 1, found, 0);
+
+            buffer_append(out, &count, sizeof(count));
+            buffer_reserve(out, sizeof(int32_t) * server->dimensions * count);
+            uint32_t i;
+            for (i=0; i<count; i++) {
+                buffer_append(out, found[i]->components, sizeof(int32_t) * server->dimensions);
+            }
+            free(found);
+        }
+        if (box != NULL) {
+            free_query_box(box);
+        }
+    } else if (job->header.type == LRT_REQUEST_BATCH) {
+        uint32_t n = 0;
+        if (length < sizeof(n)) {
+            ok = 0;
+        } else {
+            memcpy(&n, job->payload, sizeof(n));
+            offset = sizeof(n);
+            if ((uint64_t)n * sizeof(LrtBound) * server->dimensions != length - offset) {
+                ok = 0;
+            }
+        }
+        if (ok) {
+            buffer_append(out, &n, sizeof(n));
+            uint32_t i;
+            for (i=0; i<n; i++) {
+                QueryBox *box = read_box(server, job->payload, length, &offset);
+                int32_t count = count_box(server->rt, box, 1);
+                buffer_append(out, &count, sizeof(count));
+                free_query_box(box);
+            }
+        }
+    } else if (job->header.type == LRT_REQUEST_INFO) {
+        int32_t info[2] = {server->size, server->dimensions};
+        buffer_append(out, info, sizeof(info));
+    } else {
+        ok = 0;
+    }
+
+    //rewrite the header now the payload size is known
+    LrtHeader *written = (LrtHeader*)out->data;
+    if (!ok) {
+        out->size = sizeof(LrtHeader);
+        written->type = LRT_STATUS_BAD_REQUEST;
+    }
+    written->length = out->size - sizeof(LrtHeader);
+}
+
+
+void *worker_main(void *arg) {
+    Server *server = arg;
+    Job *job;
+    while ((job = queue_pop(&server->requests)) != NULL) {
+        handle_request(server, job);
+        queue_push(&server->completions, job);
+
+        uint64_t one = 1;
+        if (write(server->event_fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("eventfd write");
+        }
+    }
+
+    return NULL;
+}
+
+
+//whether the connection is below its in flight and unsent output limits
+int connection_accepts_input(Connection *conn) {
+    return conn->pending < MAX_PENDING && conn->out.size - conn->out.start < MAX_UNSENT;
+}
+
+
+//reading is only armed while the connection accepts input and has room to buffer it,
+//so a client that pipelines without reading responses is held back by the socket
+void watch_connection(Server *server, Connection *conn) {
+    uint32_t events = 0;
+    if (!conn->read_closed && connection_accepts_input(conn) && conn->in.size - conn->in.start < MAX_UNPARSED) {
+        events |= EPOLLIN;
+    }
+    if (conn->out.size > conn->out.start) {
+        events |= EPOLLOUT;
+    }
+    if (events == conn->events) {
+        return;
+    }
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.fd = conn->fd;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+    conn->events = events;
+}
+
+
+void close_connection(Server *server, Connection *conn) {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    server->connections[conn->fd] = NULL;
+    buffer_free(&conn->in);
+    buffer_free(&conn->out);
+    free(conn);
+}
+
+
+int process_input(Server *server, Connection *conn);
+
+
+//writes what the socket takes then resumes parsing if that made room,
+//returns 0 if the connection had to be closed
+int flush_connection(Server *server, Connection *conn) {
+    while (conn->out.size > conn->out.start) {
+        ssize_t written = write(conn->fd, conn->out.data + conn->out.start, conn->out.size - conn->out.start);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            close_connection(server, conn);
+            return 0;
+        }
+        conn->out.start += written;
+    }
+
+    if (conn->out.start == conn->out.size) {
+        conn->out.start = conn->out.size = 0;
+    }
+
+    return process_input(server, conn);
+}
+
+
+//hands complete requests in the input buffer to the workers until the connection
+//hits its limits, returns 0 if the connection had to be closed or was finished
+int process_input(Server *server, Connection *conn) {
+    while (connection_accepts_input(conn) && conn->in.size - conn->in.start >= sizeof(LrtHeader)) {
+        LrtHeader header;
+        memcpy(&header, conn->in.data + conn->in.start, sizeof(header));
+        if (header.length > LRT_MAX_MESSAGE) {
+            server->stats.bad_requests++;
+            close_connection(server, conn);
+            return 0;
+        }
+        if (conn->in.size - conn->in.start < sizeof(LrtHeader) + header.length) {
+            break;
+        }
+
+        Job *job = calloc(1, sizeof(Job));
+        job->fd = conn->fd;
+        job->generation = conn->generation;
+        job->header = header;
+        job->payload = malloc(header.length + 1);
+        memcpy(job->payload, conn->in.data + conn->in.start + sizeof(LrtHeader), header.length);
+        conn->in.start += sizeof(LrtHeader) + header.length;
+
+        if (header.type <= LRT_REQUEST_INFO) {
+            server->stats.requests[header.type]++;
+        }
+        conn->pending++;
+        queue_push(&server->requests, job);
+    }
+
+    if (conn->in.start == conn->in.size) {
+        conn->in.start = conn->in.size = 0;
+    }
+
+    //after a half close, stay open until every request read has been answered
+    if (conn->read_closed && conn->pending == 0 && conn->out.size == conn->out.start) {
+        close_connection(server, conn);
+        return 0;
+    }
+    watch_connection(server, conn);
+
+    return 1;
+}
+
+
+//reads until the socket is drained or MAX_UNPARSED bytes are buffered
+void read_connection(Server *server, Connection *conn) {
+    while (conn->in.size - conn->in.start < MAX_UNPARSED) {
+        buffer_reserve(&conn->in, READ_CHUNK);
+        size_t room = conn->in.capacity - conn->in.size;
+        if (room > MAX_UNPARSED - (conn->in.size - conn->in.start)) {
+            room = MAX_UNPARSED - (conn->in.size - conn->in.start);
+        }
+        ssize_t got = read(conn->fd, conn->in.data + conn->in.size, room);
+        if (got == 0) {
+            conn->read_closed = 1;
+            break;
+        }
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close_connection(server, conn);
+                return;
+            }
+            break;
+        }
+        conn->in.size += got;
+    }
+
+    process_input(server, conn);
+}
+
+
+void accept_connections(Server *server) {
+    while (1) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+
+        if (fd >= server->connection_capacity) {
+            int capacity = server->connection_capacity;
+            while (capacity <= fd) {
+                capacity *= 2;
+            }
+            server->connections = realloc(server->connections, sizeof(Connection*)*capacity);
+            memset(server->connections + server->connection_capacity, 0,
+                   sizeof(Connection*)*(capacity - server->connection_capacity));
+            server->connection_capacity = capacity;
+        }
+
+        Connection *conn = calloc(1, sizeof(Connection));
+        conn->fd = fd;
+        conn->generation = ++server->generation;
+        conn->events = EPOLLIN;
+        server->connections[fd] = conn;
+        server->stats.connections++;
+
+        struct epoll_event event;
+        event.events = conn->events;
+        event.data.fd = fd;
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+
+//moves finished jobs onto their connections' output
+void complete_jobs(Server *server) {
+    uint64_t count;
+    if (read(server->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("eventfd read");
+    }
+
+    Job *jobs = queue_drain(&server->completions);
+    Job *job;
+    for (job = jobs; job != NULL; job = job->next) {
+        if (((LrtHeader*)job->response.data)->type != LRT_STATUS_OK) {
+            server->stats.bad_requests++;
+        }
+
+        Connection *conn = job->fd < server->connection_capacity ? server->connections[job->fd] : NULL;
+        if (conn != NULL && conn->generation == job->generation) {
+            buffer_append(&conn->out, job->response.data, job->response.size);
+            conn->pending--;
+            conn->dirty = 1;
+        }
+    }
+
+    //flush each touched connection once, which also resumes parsing if it had hit its limits
+    while (jobs != NULL) {
+        Job *next = jobs->next;
+        Connection *conn = jobs->fd < server->connection_capacity ? server->connections[jobs->fd] : NULL;
+        if (conn != NULL && conn->generation == jobs->generation && conn->dirty) {
+            conn->dirty = 0;
+            flush_connection(server, conn);
+        }
+        free_job(jobs);
+        jobs = next;
+    }
+}
+
+
+int open_listen_socket(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path too long\n");
+        close(fd);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+Point **load_points(const char *path, int *size, int *dimensions) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror("fopen");
+        return NULL;
+    }
+
+    if (fscanf(f, "%d %d", size, dimensions) != 2 || *size <= 0 || *dimensions <= 0) {
+        printf("Bad points file header\n");
+        fclose(f);
+        return NULL;
+    }
+
+    Point **points = malloc(sizeof(Point*)*(*size));
+    int i, j;
+    for (i=0; i<*size; i++) {
+        points[i] = malloc(sizeof(Point));
+        points[i]->components = malloc(sizeof(int)*(*dimensions));
+        for (j=0; j<*dimensions; j++) {
+            if (fscanf(f, "%d", &points[i]->components[j]) != 1) {
+                printf("Points file ended early\n");
+                fclose(f);
+                free_points(points, i+1);
+                return NULL;
+            }
+        }
+    }
+    fclose(f);
+
+    return points;
+}
+
+
+void run_server(Server *server) {
+    struct epoll_event events[MAX_EVENTS];
+    while (!stop_requested) {
+        int ready = epoll_wait(server->epoll_fd, events, MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return;
+        }
+
+        int i;
+        for (i=0; i<ready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == server->listen_fd) {
+                accept_connections(server);
+            } else if (fd == server->event_fd) {
+                complete_jobs(server);
+            } else if (fd < server->connection_capacity && server->connections[fd] != NULL) {
+                Connection *conn = server->connections[fd];
+                //the client closed both directions so nothing left can be delivered,
+                //these are reported even while reading is paused
+                if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                    close_connection(server, conn);
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT) {
+                    if (!flush_connection(server, conn)) {
+                        continue;
+                    }
+                }
+                if (events[i].events & EPOLLIN) {
+                    read_connection(server, conn);
+                }
+            }
+        }
+    }
+}
+
+
+int main(int argc, char **argv) {
+    const char *socket_path = NULL;
+    const char *points_path = NULL;
+    int size = 100000;
+    int dimensions = 3;
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int option;
+    while ((option = getopt(argc, argv, "s:f:n:d:w:")) != -1) {
+        switch (option) {
+            case 's': socket_path = optarg; break;
+            case 'f': points_path = optarg; break;
+            case 'n': size = atoi(optarg); break;
+            case 'd': dimensions = atoi(optarg); break;
+            case 'w': workers = atoi(optarg); break;
+            default:
+                printf("usage: %s -s SOCKET [-f POINTS_FILE | -n SIZE -d DIMENSIONS] [-w WORKERS]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (socket_path == NULL || size <= 0 || dimensions <= 0) {
+        printf("usage: %s -s SOCKET [-f POINTS_FILE | -n SIZE -d DIMENSIONS] [-w WORKERS]\n", argv[0]);
+        return 1;
+    }
+    workers = max(workers, 1);
+
+    Point **points = points_path != NULL ? load_points(points_path, &size, &dimensions) :
+                                           generate_random(size, dimensions);
+    if (points == NULL) {
+        return 1;
+    }
+
+    Server server;
+    memset(&server, 0, sizeof(server));
+    server.size = size;
+    server.dimensions = dimensions;
+
+    clock_t t = clock();
+    Arena *arena = create_arena(ARENA_PAGES_TRANSPARENT, ARENA_NUMA_INTERLEAVE, -1);
+    Point **tree_points = arena_alloc(arena, sizeof(Point*)*size);
+    memcpy(tree_points, points, sizeof(Point*)*size);
+    server.rt = build_range_tree_arena(tree_points, size, 1, dimensions, NULL, arena);
+    printf("Built %d points in %d dimensions in %f seconds\n", size, dimensions, elapsed_seconds(t));
+
+    server.listen_fd = open_listen_socket(socket_path);
+    if (server.listen_fd < 0) {
+        return 1;
+    }
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server.connection_capacity = 64;
+    server.connections = calloc(server.connection_capacity, sizeof(Connection*));
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = server.listen_fd;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &event);
+    event.data.fd = server.event_fd;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.event_fd, &event);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    queue_init(&server.requests);
+    queue_init(&server.completions);
+    server.worker_count = workers;
+    server.workers = malloc(sizeof(pthread_t)*workers);
+    int i;
+    for (i=0; i<workers; i++) {
+        pthread_create(&server.workers[i], NULL, worker_main, &server);
+    }
+
+    printf("Serving on %s with %d workers\n", socket_path, workers);
+    fflush(stdout);
+    run_server(&server);
+
+    queue_stop(&server.requests);
+    for (i=0; i<workers; i++) {
+        pthread_join(server.workers[i], NULL);
+    }
+
+    printf("Served %ld connections: %ld count, %ld query, %ld batch, %ld info, %ld bad requests\n",
+           server.stats.connections, server.stats.requests[LRT_REQUEST_COUNT],
+           server.stats.requests[LRT_REQUEST_QUERY], server.stats.requests[LRT_REQUEST_BATCH],
+           server.stats.requests[LRT_REQUEST_INFO], server.stats.bad_requests);
+
+    Job *job = queue_drain(&server.requests);
+    while (job != NULL) {
+        Job *next = job->next;
+        free_job(job);
+        job = next;
+    }
+    job = queue_drain(&server.completions);
+    while (job != NULL) {
+        Job *next = job->next;
+        free_job(job);
+        job = next;
+    }
+    for (i=0; i<server.connection_capacity; i++) {
+        if (server.connections[i] != NULL) {
+            close_connection(&server, server.connections[i]);
+        }
+    }
+    free(server.connections);
+    free(server.workers);
+    close(server.event_fd);
+    close(server.epoll_fd);
+    close(server.listen_fd);
+    unlink(socket_path);
+
+    free_range_tree(server.rt);
+    free_points(points, size);
+
+    return 0;
+}